@@ -0,0 +1,221 @@
+#include "aio.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * io_uring engine, driven through the raw system calls so that no library
+ * is needed. Every request is sent to the kernel as soon as it is submitted.
+ */
+class Uring_IO : public Async_IO {
+ public:
+  Uring_IO(int file, int depth) {
+    fd = file;
+    ring_fd = -1;
+    sq_ring = cq_ring = MAP_FAILED;
+    sqes = (io_uring_sqe *)MAP_FAILED;
+
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring_fd < 0) return;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) sq_size = cq_size = max(sq_size, cq_size);
+
+    sq_ring = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) return;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ring = sq_ring;
+    } else {
+      cq_ring = mmap(0, cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+      if (cq_ring == MAP_FAILED) return;
+    }
+
+    sqes = (io_uring_sqe *)mmap(0, p.sq_entries * sizeof(io_uring_sqe),
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ring_fd,
+                                IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return;
+    nsqes = p.sq_entries;
+
+    char *sq = (char *)sq_ring;
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    char *cq = (char *)cq_ring;
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+  }
+
+  ~Uring_IO() {
+    if (sqes != MAP_FAILED) munmap(sqes, nsqes * sizeof(io_uring_sqe));
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_size);
+    if (ring_fd >= 0) close(ring_fd);
+  }
+
+  bool ready() { return sqes != MAP_FAILED; }
+
+  void submit(request *r) {
+    unsigned tail = *sq_tail;
+    unsigned slot = tail & sq_mask;
+
+    io_uring_sqe *sqe = &sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = r->offset;
+    sqe->addr = (unsigned long)&r->iov;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long)r;
+
+    sq_array[slot] = slot;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    enter(1, 0);
+  }
+
+  int reap(request **done, int max, bool wait) {
+    int n = 0;
+    while (n < max) {
+      unsigned head = *cq_head;
+      if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        if (n > 0 || !wait) break;
+        enter(0, 1);
+        continue;
+      }
+
+      io_uring_cqe *cqe = &cqes[head & cq_mask];
+      request *r = (request *)(unsigned long)cqe->user_data;
+      r->result = cqe->res;
+      done[n++] = r;
+      __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    return n;
+  }
+
+  const char *name() { return "io_uring"; }
+
+ private:
+  int fd;
+  int ring_fd;
+  void *sq_ring, *cq_ring;
+  size_t sq_size, cq_size;
+  io_uring_sqe *sqes;
+  unsigned nsqes;
+
+  unsigned *sq_tail, *sq_array, sq_mask;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  io_uring_cqe *cqes;
+
+  void enter(unsigned to_submit, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    while (syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags, 0, 0) < 0 &&
+           errno == EINTR) {
+    }
+  }
+};
+
+/**
+ * Fallback engine: a fixed set of threads doing blocking preadv/pwritev.
+ */
+class Thread_Pool_IO : public Async_IO {
+ public:
+  Thread_Pool_IO(int file, int nthreads) {
+    fd = file;
+    stopping = false;
+    for (int i = 0; i < nthreads; ++i)
+      workers.emplace_back([this]() { work(); });
+  }
+
+  ~Thread_Pool_IO() {
+    {
+      lock_guard<mutex> lock(m);
+      stopping = true;
+    }
+    queued.notify_all();
+    for (thread &t : workers) t.join();
+  }
+
+  void submit(request *r) {
+    {
+      lock_guard<mutex> lock(m);
+      pending.push_back(r);
+    }
+    queued.notify_one();
+  }
+
+  int reap(request **done, int max, bool wait) {
+    unique_lock<mutex> lock(m);
+    if (wait) finished_cv.wait(lock, [this]() { return !finished.empty(); });
+
+    int n = 0;
+    while (n < max && !finished.empty()) {
+      done[n++] = finished.front();
+      finished.pop_front();
+    }
+    return n;
+  }
+
+  const char *name() { return "thread pool"; }
+
+ private:
+  int fd;
+  bool stopping;
+  vector<thread> workers;
+  mutex m;
+  condition_variable queued, finished_cv;
+  deque<request *> pending, finished;
+
+  void work() {
+    unique_lock<mutex> lock(m);
+    while (true) {
+      queued.wait(lock, [this]() { return stopping || !pending.empty(); });
+      if (pending.empty()) return;
+
+      request *r = pending.front();
+      pending.pop_front();
+      lock.unlock();
+
+      ssize_t n;
+      do {
+        n = r->write ? pwritev(fd, &r->iov, 1, r->offset)
+                     : preadv(fd, &r->iov, 1, r->offset);
+      } while (n < 0 && errno == EINTR);
+      r->result = n < 0 ? -errno : n;
+
+      lock.lock();
+      finished.push_back(r);
+      finished_cv.notify_one();
+    }
+  }
+};
+
+Async_IO *Async_IO::create(int fd, int depth) {
+  Uring_IO *uring = new Uring_IO(fd, depth);
+  if (uring->ready()) return uring;
+  delete uring;
+
+  return new Thread_Pool_IO(fd, min(depth, 4));
+}
@@ -0,0 +1,44 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Asynchronous positional I/O on a file descriptor. Requests are queued with
+ * submit() and handed back by reap() once the kernel (or a worker thread)
+ * has finished them; nothing is done with a request between the two calls.
+ */
+class Async_IO {
+ public:
+  struct request {
+    bool write;
+    off_t offset;
+    struct iovec iov;
+    // Bytes transferred, or -errno. Filled in before reap() returns it.
+    ssize_t result;
+    // Free for the submitter to use.
+    void *owner;
+  };
+
+  virtual ~Async_IO() {}
+
+  virtual void submit(request *r) = 0;
+
+  /**
+   * Store up to max finished requests in done and return how many there
+   * were. If wait is set and nothing has finished yet, block until at least
+   * one request finishes.
+   */
+  virtual int reap(request **done, int max, bool wait) = 0;
+
+  virtual const char *name() = 0;
+
+  /**
+   * Create an engine for fd: io_uring when the kernel supports it, a pool of
+   * threads doing pread/pwrite otherwise.
+   */
+  static Async_IO *create(int fd, int depth);
+};
+
+#endif
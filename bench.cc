@@ -0,0 +1,830 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "disk.h"
+#include "fs.h"
+
+using namespace std;
+
+/**
+ * Benchmarks for the file system, run by `make bench`. Every benchmark
+ * works on a freshly formatted image, so runs with the same options and
+ * seed do the same operations. For each one, a line gives the operations
+ * timed, operations and megabytes per second, latency percentiles and the
+ * disk blocks read and written per operation.
+ *
+ * The messages the file system prints (such as the disk full error the
+ * fill benchmark runs into) are silenced.
+ *
+ * Some benchmarks also check what they read back; a mismatch is printed
+ * as a FAILED line, and the program then exits with status 1. `make check`
+ * runs those: stress, crash, fill and small.
+ */
+namespace {
+
+const int KB = 1024;
+const int MB = 1024 * KB;
+const int IO_SIZES[] = {512, 4 * KB, 64 * KB, MB};
+// Image sizes, in blocks, the mount benchmark is run on besides -b.
+const int MOUNT_SIZES[] = {5, 20, 200, 2000, 20000};
+
+struct options {
+  int blocks = 32768;
+  unsigned seed = 1;
+  int threads = 4;
+  int cache_blocks = Block_Cache::DEFAULT_CAPACITY;
+  bool mapped = false;
+  bool extents = true;
+  string dir = ".";
+};
+
+options opt;
+atomic<int> failures(0);
+
+typedef chrono::steady_clock timer;
+
+double seconds_since(timer::time_point start) {
+  return chrono::duration<double>(timer::now() - start).count();
+}
+
+/**
+ * A fresh image of nblocks, formatted and mounted, deleted again when done.
+ */
+class Image {
+ public:
+  Disk disk;
+  INE5412_FS fs;
+
+  Image(int nblocks)
+      : disk(prepare(), nblocks, opt.mapped),
+        fs(&disk, opt.cache_blocks, opt.extents) {
+    fs.fs_format();
+    fs.fs_mount();
+  }
+
+  ~Image() {
+    disk.close();
+    unlink(path().c_str());
+  }
+
+  // Unmount and mount again, so that nothing of the files is cached.
+  void remount() {
+    fs.fs_umount();
+    fs.fs_mount();
+  }
+
+ private:
+  static string path() { return opt.dir + "/bench.img"; }
+
+  static const char *prepare() {
+    static string p;
+    p = path();
+    unlink(p.c_str());
+    return p.c_str();
+  }
+};
+
+/**
+ * Timings of one benchmark: the latency of every operation, plus the time,
+ * bytes and disk blocks of the whole run.
+ */
+class Result {
+ public:
+  Result(Disk *d) : disk(d) { restart(); }
+
+  void restart() {
+    reads = disk->reads();
+    writes = disk->writes();
+    start = timer::now();
+  }
+
+  /**
+   * Time one operation of bytes.
+   */
+  void time(long bytes, const function<void()> &op) {
+    timer::time_point t = timer::now();
+    op();
+    add(seconds_since(t), bytes);
+  }
+
+  /**
+   * Count an operation of bytes timed elsewhere.
+   */
+  void add(double seconds, long bytes) {
+    latencies.push_back(seconds);
+    total_bytes += bytes;
+  }
+
+  void print(const string &name) {
+    double elapsed = seconds_since(start);
+    int n = latencies.size();
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+      return n ? latencies[(int)(p * (n - 1))] * 1e6 : 0;
+    };
+
+    printf("%-20s %8d %10.0f %8.1f %8.1f %8.1f %8.1f %9.1f %7.2f %7.2f\n",
+           name.c_str(), n, n / elapsed, total_bytes / elapsed / MB,
+           percentile(0.5), percentile(0.9), percentile(0.99), percentile(1),
+           n ? (double)(disk->reads() - reads) / n : 0,
+           n ? (double)(disk->writes() - writes) / n : 0);
+  }
+
+ private:
+  Disk *disk;
+  vector<double> latencies;
+  long total_bytes = 0;
+  int reads, writes;
+  timer::time_point start;
+};
+
+void fail(const string &what) {
+  printf("FAILED: %s\n", what.c_str());
+  failures++;
+}
+
+void print_header() {
+  printf("%-20s %8s %10s %8s %8s %8s %8s %9s %7s %7s\n", "benchmark", "ops",
+         "ops/s", "MB/s", "p50 us", "p90 us", "p99 us", "max us", "rd/op",
+         "wr/op");
+}
+
+// Size of the file the read and write benchmarks use: a quarter of the
+// image, at most 64 MB.
+long file_bytes() {
+  return min((long)opt.blocks * Disk::DISK_BLOCK_SIZE / 4, 64L * MB);
+}
+
+/**
+ * Write file inumber of image from start to end in calls of size bytes.
+ */
+void fill_file(Image &image, int inumber, long bytes, int size,
+               Result *result = nullptr) {
+  vector<char> data(size, 'x');
+  for (long offset = 0; offset < bytes; offset += size) {
+    int length = min((long)size, bytes - offset);
+    auto write = [&]() {
+      image.fs.fs_write(inumber, data.data(), length, offset);
+    };
+    if (result)
+      result->time(length, write);
+    else
+      write();
+  }
+}
+
+void bench_sequential() {
+  for (int size : IO_SIZES) {
+    long bytes = file_bytes();
+    Image image(opt.blocks);
+    int inumber = image.fs.fs_create();
+
+    // The final sync is part of the run, so MB/s includes getting the data
+    // to the disk
+    Result write(&image.disk);
+    fill_file(image, inumber, bytes, size, &write);
+    image.fs.fs_sync();
+    write.print("seq_write/" + to_string(size));
+
+    image.remount();
+    Result read(&image.disk);
+    vector<char> data(size);
+    for (long offset = 0; offset < bytes; offset += size)
+      read.time(size, [&]() {
+        image.fs.fs_read(inumber, data.data(), size, offset);
+      });
+    read.print("seq_read/" + to_string(size));
+  }
+}
+
+void bench_random() {
+  mt19937 random(opt.seed);
+  long bytes = file_bytes();
+
+  for (int size : IO_SIZES) {
+    Image image(opt.blocks);
+    int inumber = image.fs.fs_create();
+    fill_file(image, inumber, bytes, 64 * KB);
+    image.remount();
+
+    long slots = bytes / size;
+    int nops = (int)min(slots, 20000L);
+    vector<char> data(size, 'y');
+
+    Result read(&image.disk);
+    for (int i = 0; i < nops; ++i) {
+      long offset = (long)(random() % slots) * size;
+      read.time(size, [&]() {
+        image.fs.fs_read(inumber, data.data(), size, offset);
+      });
+    }
+    read.print("rand_read/" + to_string(size));
+
+    Result write(&image.disk);
+    for (int i = 0; i < nops; ++i) {
+      long offset = (long)(random() % slots) * size;
+      write.time(size, [&]() {
+        image.fs.fs_write(inumber, data.data(), size, offset);
+      });
+    }
+    image.fs.fs_sync();
+    write.print("rand_write/" + to_string(size));
+  }
+}
+
+void bench_churn() {
+  const int ROUNDS = 5000;
+  Image image(opt.blocks);
+  vector<char> data(4 * KB, 'z');
+
+  // Each operation creates a file, writes a block to it and deletes it
+  Result result(&image.disk);
+  for (int i = 0; i < ROUNDS; ++i)
+    result.time(data.size(), [&]() {
+      int inumber = image.fs.fs_create();
+      image.fs.fs_write(inumber, data.data(), data.size(), 0);
+      image.fs.fs_delete(inumber);
+    });
+  image.fs.fs_sync();
+  result.print("churn");
+}
+
+void bench_mount() {
+  const int ROUNDS = 5;
+  vector<int> sizes(begin(MOUNT_SIZES), end(MOUNT_SIZES));
+  if (find(sizes.begin(), sizes.end(), opt.blocks) == sizes.end())
+    sizes.push_back(opt.blocks);
+  sort(sizes.begin(), sizes.end());
+
+  for (int nblocks : sizes) {
+    // Half full, in files of 16 KB
+    Image image(nblocks);
+    vector<char> data(16 * KB, 'm');
+    for (long used = 0; used < (long)nblocks * Disk::DISK_BLOCK_SIZE / 2;
+         used += data.size()) {
+      int inumber = image.fs.fs_create();
+      if (inumber <= 0 ||
+          image.fs.fs_write(inumber, data.data(), data.size(), 0) <= 0)
+        break;
+    }
+    image.fs.fs_umount();
+
+    Result result(&image.disk);
+    for (int i = 0; i < ROUNDS; ++i) {
+      result.time(0, [&]() { image.fs.fs_mount(); });
+      image.fs.fs_umount();
+    }
+    result.print("mount/" + to_string(nblocks));
+  }
+}
+
+/**
+ * Files of 1 MB, written 64 KB at a time, until the disk is full. Then
+ * writes past the end of a file of 100 bytes with blocks reserved past its
+ * end must fail without the file growing.
+ */
+void bench_fill() {
+  Image image(opt.blocks);
+  vector<char> data(64 * KB, 'f');
+
+  const int PROBE_SIZE = 100;
+  int probe = image.fs.fs_create();
+  image.fs.fs_write(probe, data.data(), PROBE_SIZE, 0);
+  image.fs.fs_fallocate(probe, 16 * KB);
+
+  Result result(&image.disk);
+  bool full = false;
+  while (!full) {
+    int inumber = image.fs.fs_create();
+    if (inumber <= 0) break;
+    for (int offset = 0; offset < MB && !full; offset += data.size())
+      result.time(data.size(), [&]() {
+        full = image.fs.fs_write(inumber, data.data(), data.size(), offset) <
+               (int)data.size();
+      });
+  }
+  image.fs.fs_sync();
+  result.print("fill");
+
+  struct iovec iov = {data.data(), data.size()};
+  size_t streamed = 0;
+  auto fill = [&](char *buffer, int n) {
+    n = min(n, (int)(data.size() - streamed));
+    memcpy(buffer, data.data() + streamed, n);
+    streamed += n;
+    return n;
+  };
+  int written[] = {
+      image.fs.fs_write(probe, data.data(), data.size(), MB),
+      image.fs.fs_writev(probe, &iov, 1, MB),
+      image.fs.fs_write_stream(probe, MB, data.size(), fill),
+  };
+  for (int n : written)
+    if (n == (int)data.size())
+      fail("fill: write past the end succeeded on a full disk");
+  if (image.fs.fs_getsize(probe) != PROBE_SIZE)
+    fail("fill: failed writes past the end grew the file to " +
+         to_string(image.fs.fs_getsize(probe)) + " bytes");
+}
+
+/**
+ * Files of 100 to 500 bytes, written whole, then read back and checked
+ * after a remount. A last line gives the data blocks the files take.
+ */
+void bench_small() {
+  const int FILES = 2000;
+  Image image(opt.blocks);
+  mt19937 random(opt.seed);
+
+  vector<int> inumbers;
+  vector<string> contents;
+  for (int i = 0; i < FILES; ++i) {
+    string text(100 + random() % 401, 0);
+    for (char &c : text) c = 'a' + random() % 26;
+    contents.push_back(text);
+  }
+
+  Result write(&image.disk);
+  for (const string &text : contents)
+    write.time(text.size(), [&]() {
+      int inumber = image.fs.fs_create();
+      image.fs.fs_write(inumber, text.data(), text.size(), 0);
+      inumbers.push_back(inumber);
+    });
+  image.fs.fs_sync();
+  write.print("small/write");
+
+  image.remount();
+  Result read(&image.disk);
+  string data(512, 0);
+  for (int i = 0; i < FILES; ++i) {
+    int n = 0;
+    read.time(contents[i].size(), [&]() {
+      n = image.fs.fs_read(inumbers[i], &data[0], data.size(), 0);
+    });
+    if (n != (int)contents[i].size() || data.compare(0, n, contents[i]))
+      fail("small: file " + to_string(inumbers[i]) + " reads back wrong");
+  }
+  read.print("small/read");
+
+  long bytes = 0;
+  int blocks = 0;
+  for (int i = 0; i < FILES; ++i) {
+    INE5412_FS::fs_stat_info info;
+    image.fs.fs_stat(inumbers[i], &info);
+    blocks += info.blocks;
+    bytes += contents[i].size();
+  }
+  printf("%-20s %8d data blocks for %ld bytes\n", "blocks/small", blocks,
+         bytes);
+}
+
+/**
+ * Throughput of 1, 2, 4... threads up to -t, each reading and writing 4 KB
+ * blocks of a file of its own, half of the operations of each kind.
+ */
+void bench_threads() {
+  const int OPS_PER_THREAD = 4000;
+  long bytes = min(file_bytes() / opt.threads, 16L * MB);
+  long slots = bytes / (4 * KB);
+
+  for (int nthreads = 1; nthreads <= opt.threads; nthreads *= 2) {
+    Image image(opt.blocks);
+    vector<int> inumbers;
+    for (int t = 0; t < nthreads; ++t) {
+      inumbers.push_back(image.fs.fs_create());
+      fill_file(image, inumbers.back(), bytes, 64 * KB);
+    }
+    image.remount();
+
+    // Latencies are kept per thread and merged afterwards
+    vector<vector<double>> latencies(nthreads);
+    Result result(&image.disk);
+    vector<thread> threads;
+    for (int t = 0; t < nthreads; ++t)
+      threads.emplace_back([&, t]() {
+        mt19937 random(opt.seed + t);
+        vector<char> data(4 * KB, 't');
+        for (int i = 0; i < OPS_PER_THREAD; ++i) {
+          long offset = (long)(random() % slots) * data.size();
+          timer::time_point start = timer::now();
+          if (i % 2)
+            image.fs.fs_write(inumbers[t], data.data(), data.size(), offset);
+          else
+            image.fs.fs_read(inumbers[t], data.data(), data.size(), offset);
+          latencies[t].push_back(seconds_since(start));
+        }
+      });
+    for (thread &t : threads) t.join();
+    image.fs.fs_sync();
+
+    for (auto &l : latencies)
+      for (double seconds : l) result.add(seconds, 4 * KB);
+    result.print("threads/" + to_string(nthreads));
+  }
+}
+
+/**
+ * Writing and reading back a file of log lines, plain and compressed. After
+ * the runs of each, a line gives the data blocks the file takes.
+ */
+void bench_compress() {
+  const char *WORDS[] = {"GET",  "POST",   "/index.html", "/api/v1/items",
+                         "200",  "404",    "user=alice",  "user=bob",
+                         "ok",   "cached", "took",        "ms"};
+  mt19937 random(opt.seed);
+  long bytes = file_bytes();
+  string text;
+  for (int line = 0; (long)text.size() < bytes; ++line) {
+    text += "2026-10-16 12:" + to_string(10 + line / 6000 % 50) + ":" +
+            to_string(10 + line / 100 % 60) + " ";
+    for (int i = 0; i < 6; ++i) text += WORDS[random() % 12] + string(" ");
+    text += to_string(random() % 1000) + "\n";
+  }
+
+  for (bool compressed : {false, true}) {
+    Image image(opt.blocks);
+    int inumber = image.fs.fs_create();
+    if (compressed && !image.fs.fs_compress(inumber)) return;
+    string name = compressed ? "compressed" : "plain";
+    int size = 64 * KB;
+
+    Result write(&image.disk);
+    for (long offset = 0; offset < bytes; offset += size) {
+      int length = min((long)size, bytes - offset);
+      write.time(length, [&]() {
+        image.fs.fs_write(inumber, text.data() + offset, length, offset);
+      });
+    }
+    image.fs.fs_sync();
+    write.print("write/" + name);
+
+    image.remount();
+    Result read(&image.disk);
+    vector<char> data(size);
+    for (long offset = 0; offset < bytes; offset += size)
+      read.time(size, [&]() {
+        image.fs.fs_read(inumber, data.data(), size, offset);
+      });
+    read.print("read/" + name);
+
+    INE5412_FS::fs_stat_info info;
+    image.fs.fs_stat(inumber, &info);
+    printf("%-20s %8d data blocks for %ld bytes\n", ("blocks/" + name).c_str(),
+           info.blocks, bytes);
+  }
+}
+
+/**
+ * Run work on a freshly formatted image at path in a child process, which
+ * is then killed without unmounting.
+ */
+void run_and_crash(const string &path,
+                   const function<void(INE5412_FS &)> &work) {
+  unlink(path.c_str());
+  fflush(stdout);
+  pid_t child = fork();
+  if (child == 0) {
+    Disk disk(path.c_str(), opt.blocks, opt.mapped);
+    INE5412_FS fs(&disk, opt.cache_blocks, opt.extents);
+    fs.fs_format();
+    fs.fs_mount();
+    work(fs);
+    kill(getpid(), SIGKILL);
+  }
+  waitpid(child, nullptr, 0);
+}
+
+/**
+ * Crash recovery, checked after mounting the image of a killed process
+ * again, which replays the journal; the time is that of the mount.
+ *
+ * crash/plain writes files of 6000 bytes, whose last 1904 bytes are a
+ * partial block, through several group commits: every file must then be
+ * either empty (created after the last commit) or hold all of its data.
+ *
+ * crash/compressed writes a compressed file of log lines and syncs it,
+ * then writes random bytes over part of each cluster, which no longer
+ * compresses the same way: every cluster must read back as either its old
+ * or its new data.
+ *
+ * A mapped disk has no journal, so there is nothing to check on one.
+ */
+void bench_crash() {
+  const int FILES = 40, SIZE = 6000;
+  const int CLUSTERS = 4, PATCH_OFFSET = 6000, PATCH_SIZE = 20000;
+  const int CLUSTER_SIZE = INE5412_FS::CLUSTER_SIZE;
+  if (opt.mapped) {
+    printf("%-20s skipped, a mapped disk has no journal\n", "crash");
+    return;
+  }
+  string path = opt.dir + "/crash.img";
+
+  auto contents = [&](int i) {
+    string data(SIZE, 0);
+    for (int k = 0; k < SIZE; ++k) data[k] = 'a' + (i * 7 + k) % 26;
+    return data;
+  };
+
+  run_and_crash(path, [&](INE5412_FS &fs) {
+    for (int i = 0; i < FILES; ++i) {
+      int inumber = fs.fs_create();
+      string data = contents(i);
+      fs.fs_write(inumber, data.data(), SIZE, 0);
+    }
+  });
+  {
+    Disk disk(path.c_str(), opt.blocks, opt.mapped);
+    INE5412_FS fs(&disk, opt.cache_blocks, opt.extents);
+    Result result(&disk);
+    result.time(0, [&]() { fs.fs_mount(); });
+    result.print("crash/plain");
+
+    // Inodes are taken in order from 1
+    int recovered = 0;
+    for (int i = 0; i < FILES; ++i) {
+      int size = fs.fs_getsize(i + 1);
+      if (size <= 0) continue;
+      string data(SIZE, 0);
+      if (size != SIZE || fs.fs_read(i + 1, &data[0], SIZE, 0) != SIZE ||
+          data != contents(i))
+        fail("crash: inode " + to_string(i + 1) + " lost data");
+      recovered++;
+    }
+    if (!recovered) fail("crash: no file survived the crash");
+    fs.fs_umount();
+    disk.close();
+  }
+
+  string text, patch(PATCH_SIZE, 0);
+  for (int line = 0; (int)text.size() < CLUSTERS * CLUSTER_SIZE; ++line)
+    text += "line " + to_string(line) + ": GET /index.html 200 ok\n";
+  text.resize(CLUSTERS * CLUSTER_SIZE);
+  mt19937 random(opt.seed);
+  for (char &c : patch) c = (char)random();
+  string patched = text;
+  for (int c = 0; c < CLUSTERS; ++c)
+    patched.replace(c * CLUSTER_SIZE + PATCH_OFFSET, PATCH_SIZE, patch);
+
+  run_and_crash(path, [&](INE5412_FS &fs) {
+    int inumber = fs.fs_create();
+    fs.fs_compress(inumber);
+    fs.fs_write(inumber, text.data(), text.size(), 0);
+    fs.fs_sync();
+    for (int c = 0; c < CLUSTERS; ++c)
+      fs.fs_write(inumber, patch.data(), PATCH_SIZE,
+                  c * CLUSTER_SIZE + PATCH_OFFSET);
+  });
+  {
+    Disk disk(path.c_str(), opt.blocks, opt.mapped);
+    INE5412_FS fs(&disk, opt.cache_blocks, opt.extents);
+    Result result(&disk);
+    result.time(0, [&]() { fs.fs_mount(); });
+    result.print("crash/compressed");
+
+    string data(text.size(), 0);
+    if (fs.fs_read(1, &data[0], data.size(), 0) != (int)data.size())
+      fail("crash: the compressed file lost its size");
+    for (int c = 0; c < CLUSTERS; ++c) {
+      string got = data.substr(c * CLUSTER_SIZE, CLUSTER_SIZE);
+      if (got != text.substr(c * CLUSTER_SIZE, CLUSTER_SIZE) &&
+          got != patched.substr(c * CLUSTER_SIZE, CLUSTER_SIZE))
+        fail("crash: compressed cluster " + to_string(c) +
+             " is neither its old nor its new data");
+    }
+    fs.fs_umount();
+    disk.close();
+  }
+  unlink(path.c_str());
+}
+
+/**
+ * Correctness under contention, for 1, 2, 4... threads up to -t. Every
+ * thread writes and reads back its own region of each of a few shared
+ * files, half of them compressed; the regions are not block aligned, so
+ * threads share blocks and clusters and wait on each other's inode locks.
+ * Each thread also creates, writes, reads, truncates and deletes files of
+ * its own. Reads are checked against an in-memory copy as they happen, and
+ * every file again once the image is mounted anew. The time is that of
+ * the operations, all kinds mixed.
+ */
+void bench_stress() {
+  const int OPS_PER_THREAD = 3000, SHARED = 4, REGION = 5000, PRIVATE = 4;
+  const int MAX_PRIVATE_SIZE = 256 * KB;
+
+  struct worker {
+    vector<vector<char>> regions;  // of each shared file
+    vector<int> region_ends;       // bytes of each region written so far
+    vector<pair<int, string>> files;
+    string error;
+  };
+
+  for (int nthreads = 1; nthreads <= opt.threads; nthreads *= 2) {
+    Image image(opt.blocks);
+    INE5412_FS &fs = image.fs;
+    vector<int> shared;
+    for (int f = 0; f < SHARED; ++f) {
+      shared.push_back(fs.fs_create());
+      if (f % 2) fs.fs_compress(shared.back());
+    }
+
+    vector<worker> workers(nthreads);
+    // Latency and bytes of each operation, kept per thread
+    vector<vector<pair<double, int>>> timings(nthreads);
+    Result result(&image.disk);
+    vector<thread> threads;
+    for (int t = 0; t < nthreads; ++t)
+      threads.emplace_back([&, t]() {
+        mt19937 random(opt.seed + t);
+        worker &w = workers[t];
+        w.regions.assign(SHARED, vector<char>(REGION, 0));
+        w.region_ends.assign(SHARED, 0);
+        vector<char> data(MAX_PRIVATE_SIZE + 8 * KB);
+        auto check = [&](bool ok, const string &what) {
+          if (!ok && w.error.empty())
+            w.error = "stress: thread " + to_string(t) + " " + what;
+        };
+
+        for (int i = 0; i < OPS_PER_THREAD && w.error.empty(); ++i) {
+          int op = random() % 10, bytes = 0;
+          timer::time_point start = timer::now();
+          if (op < 5) {
+            // Shared files: write a piece of the region, or read it back
+            int f = random() % SHARED;
+            vector<char> &region = w.regions[f];
+            int base = t * REGION;
+            if (op < 4) {
+              int offset = random() % REGION;
+              int length = 1 + random() % (REGION - offset);
+              for (int k = 0; k < length; ++k) data[k] = (char)random();
+              int n = fs.fs_write(shared[f], data.data(), length,
+                                  base + offset);
+              check(n == length, "short write to a shared file");
+              bytes = n;
+              memcpy(&region[offset], data.data(), length);
+              w.region_ends[f] = max(w.region_ends[f], offset + length);
+            } else {
+              int n = fs.fs_read(shared[f], data.data(), REGION, base);
+              bytes = n;
+              check(n >= w.region_ends[f] &&
+                        !memcmp(data.data(), region.data(), max(n, 0)),
+                    "read back wrong data from a shared file");
+            }
+          } else if (op == 5 || w.files.empty()) {
+            // Create a file while there is room for one, else delete one
+            if ((int)w.files.size() < PRIVATE) {
+              int inumber = fs.fs_create();
+              check(inumber > 0, "could not create a file");
+              w.files.push_back({inumber, ""});
+            } else {
+              int k = random() % w.files.size();
+              check(fs.fs_delete(w.files[k].first), "could not delete");
+              w.files.erase(w.files.begin() + k);
+            }
+          } else {
+            auto &file = w.files[random() % w.files.size()];
+            string &model = file.second;
+            if (op < 8) {
+              int offset = random() % (model.size() + 4 * KB);
+              int length = 1 + random() % (32 * KB);
+              length = min(length, MAX_PRIVATE_SIZE - offset);
+              if (length <= 0) continue;
+              for (int k = 0; k < length; ++k) data[k] = (char)random();
+              int n = fs.fs_write(file.first, data.data(), length, offset);
+              check(n == length, "short write to its own file");
+              bytes = n;
+              if ((int)model.size() < offset + length)
+                model.resize(offset + length);
+              model.replace(offset, length, data.data(), length);
+            } else if (op == 8) {
+              int length = random() % (model.size() + 8 * KB);
+              length = min(length, MAX_PRIVATE_SIZE);
+              check(fs.fs_truncate(file.first, length), "truncate failed");
+              model.resize(length);
+            } else {
+              int n = fs.fs_read(file.first, data.data(), model.size(), 0);
+              bytes = n;
+              check(n == (int)model.size() &&
+                        !memcmp(data.data(), model.data(), model.size()),
+                    "read back wrong data from its own file");
+            }
+          }
+          timings[t].push_back({seconds_since(start), bytes});
+        }
+      });
+    for (thread &t : threads) t.join();
+    fs.fs_sync();
+
+    for (auto &l : timings)
+      for (auto &timing : l) result.add(timing.first, max(timing.second, 0));
+    result.print("stress/" + to_string(nthreads));
+
+    // Every file, read whole after a remount: a shared one is the regions
+    // of all threads one after the other, up to the end of the last
+    // written, and zeros between the pieces written
+    image.remount();
+    auto verify = [&](int inumber, const string &expected, const string &what) {
+      string contents(expected.size() + 1, 0);
+      int n = fs.fs_read(inumber, &contents[0], contents.size(), 0);
+      contents.resize(max(n, 0));
+      if (fs.fs_getsize(inumber) != (int)expected.size() ||
+          contents != expected)
+        fail("stress/" + to_string(nthreads) + ": " + what + " is wrong");
+    };
+    for (int f = 0; f < SHARED; ++f) {
+      string expected;
+      for (int t = 0; t < nthreads; ++t) {
+        if (!workers[t].region_ends[f]) continue;
+        expected.resize(t * REGION);
+        expected.append(workers[t].regions[f].data(),
+                        workers[t].region_ends[f]);
+      }
+      verify(shared[f], expected, "shared file " + to_string(shared[f]));
+    }
+    for (worker &w : workers) {
+      if (!w.error.empty()) fail(w.error);
+      for (auto &file : w.files)
+        verify(file.first, file.second, "file " + to_string(file.first));
+    }
+  }
+}
+
+struct benchmark {
+  const char *name;
+  void (*run)();
+};
+
+const benchmark BENCHMARKS[] = {
+    {"seq", bench_sequential}, {"rand", bench_random},
+    {"churn", bench_churn},    {"mount", bench_mount},
+    {"fill", bench_fill},      {"threads", bench_threads},
+    {"compress", bench_compress}, {"crash", bench_crash},
+    {"stress", bench_stress},  {"small", bench_small},
+};
+
+void usage(const char *program) {
+  printf("use: %s [-b <blocks>] [-s <seed>] [-t <threads>] [-c <cacheblocks>]"
+         " [-m] [-p] [-d <dir>] [benchmark...]\n",
+         program);
+  printf("benchmarks are:");
+  for (const benchmark &b : BENCHMARKS) printf(" %s", b.name);
+  printf("\n");
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  vector<const benchmark *> chosen;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+      opt.blocks = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      opt.seed = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      opt.threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      opt.cache_blocks = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+      opt.dir = argv[++i];
+    } else if (!strcmp(argv[i], "-m")) {
+      opt.mapped = true;
+    } else if (!strcmp(argv[i], "-p")) {
+      opt.extents = false;
+    } else {
+      const benchmark *found = nullptr;
+      for (const benchmark &b : BENCHMARKS)
+        if (!strcmp(argv[i], b.name)) found = &b;
+      if (!found) {
+        usage(argv[0]);
+        return 1;
+      }
+      chosen.push_back(found);
+    }
+  }
+  if (opt.blocks < 64 || opt.threads < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (chosen.empty())
+    for (const benchmark &b : BENCHMARKS) chosen.push_back(&b);
+
+  cout.setstate(ios::failbit);
+  printf("%d block images, seed %u%s%s\n", opt.blocks, opt.seed,
+         opt.mapped ? ", mapped" : "", opt.extents ? "" : ", block pointers");
+  print_header();
+  for (const benchmark *b : chosen) b->run();
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+#include "bitmap.h"
+
+#include <algorithm>
+#include <cstring>
+
+Block_Bitmap::Block_Bitmap(int n) {
+  nbits = n;
+  cursor = 0;
+  words.assign((n + 63) / 64, ~0ULL);
+  summary.assign((words.size() + 63) / 64, 0);
+  dirty.assign(blocks(), true);
+
+  // Bits past the end of the last word stay used, so scans stop there.
+  if (n % 64) words.back() = (1ULL << (n % 64)) - 1;
+
+  summarize(0, words.size());
+}
+
+void Block_Bitmap::summarize(int first, int last) {
+  for (int w = first; w < last; ++w) {
+    if (words[w])
+      summary[w / 64] |= 1ULL << (w % 64);
+    else
+      summary[w / 64] &= ~(1ULL << (w % 64));
+  }
+}
+
+void Block_Bitmap::set_free(int bit) {
+  int w = bit / 64;
+  words[w] |= 1ULL << (bit % 64);
+  summary[w / 64] |= 1ULL << (w % 64);
+  dirty[bit / BITS_PER_BLOCK] = true;
+}
+
+void Block_Bitmap::set_used(int bit) {
+  int w = bit / 64;
+  words[w] &= ~(1ULL << (bit % 64));
+  if (!words[w]) summary[w / 64] &= ~(1ULL << (w % 64));
+  dirty[bit / BITS_PER_BLOCK] = true;
+}
+
+int Block_Bitmap::next_word(int word) {
+  size_t s = word / 64;
+  if (s >= summary.size()) return -1;
+
+  uint64_t bits = summary[s] & (~0ULL << (word % 64));
+  while (!bits) {
+    if (++s == summary.size()) return -1;
+    bits = summary[s];
+  }
+  return s * 64 + __builtin_ctzll(bits);
+}
+
+int Block_Bitmap::scan(int from, int to) {
+  if (from >= to) return -1;
+
+  int w = from / 64;
+  uint64_t bits = words[w] & (~0ULL << (from % 64));
+  while (!bits) {
+    w = next_word(w + 1);
+    if (w < 0 || w * 64 >= to) return -1;
+    bits = words[w];
+  }
+
+  int bit = w * 64 + __builtin_ctzll(bits);
+  return bit < to ? bit : -1;
+}
+
+int Block_Bitmap::next_free(int from) { return scan(from, nbits); }
+
+int Block_Bitmap::allocate() {
+  int bit = scan(cursor, nbits);
+  if (bit < 0) bit = scan(0, cursor);
+  if (bit < 0) return -1;
+
+  set_used(bit);
+  cursor = bit + 1 < nbits ? bit + 1 : 0;
+  return bit;
+}
+
+int Block_Bitmap::run_length(int bit, int max) {
+  int len = 0;
+  while (len < max && bit + len < nbits) {
+    int w = (bit + len) / 64, offset = (bit + len) % 64;
+    uint64_t used = ~words[w] >> offset;
+    int free = used ? __builtin_ctzll(used) : 64 - offset;
+    len += free;
+    if (free < 64 - offset) break;
+  }
+  return len < max ? len : max;
+}
+
+int Block_Bitmap::find_free_run(int n) {
+  if (n <= 0) return -1;
+
+  // Look from the cursor to the end first, then from the start.
+  int ranges[2][2] = {{cursor, nbits}, {0, cursor}};
+  for (auto &range : ranges) {
+    int bit = scan(range[0], range[1]);
+    while (bit >= 0) {
+      int len = run_length(bit, n);
+      if (len == n) return bit;
+      bit = scan(bit + len, range[1]);
+    }
+  }
+  return -1;
+}
+
+int Block_Bitmap::count_free() {
+  int n = 0;
+  for (uint64_t w : words) n += __builtin_popcountll(w);
+  return n;
+}
+
+void Block_Bitmap::load_block(int index, const char *data) {
+  int first = index * WORDS_PER_BLOCK;
+  int last = min((int)words.size(), first + WORDS_PER_BLOCK);
+  memcpy(&words[first], data, (last - first) * sizeof(uint64_t));
+
+  if (last == (int)words.size() && nbits % 64)
+    words.back() &= (1ULL << (nbits % 64)) - 1;
+
+  summarize(first, last);
+  dirty[index] = false;
+}
+
+void Block_Bitmap::store_block(int index, char *data) {
+  int first = index * WORDS_PER_BLOCK;
+  int last = min((int)words.size(), first + WORDS_PER_BLOCK);
+
+  memset(data, 0, Disk::DISK_BLOCK_SIZE);
+  memcpy(data, &words[first], (last - first) * sizeof(uint64_t));
+}
+
+void Block_Bitmap::mark_dirty() { fill(dirty.begin(), dirty.end(), true); }
+
+void Block_Bitmap::mark_clean() { fill(dirty.begin(), dirty.end(), false); }
@@ -0,0 +1,100 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "disk.h"
+
+using namespace std;
+
+/**
+ * Bitmap of free blocks (or inodes), one bit per block (set when the block is
+ * free) packed in 64-bit words. A second level has one bit per word, set when the
+ * word still has a free block, so full regions of the disk are skipped 4096
+ * blocks at a time. Allocation is next-fit: the search starts where the last
+ * one stopped and wraps around at the end.
+ *
+ * On disk the bitmap takes blocks() consecutive blocks, each one holding
+ * BITS_PER_BLOCK bits. Blocks changed since the last mark_clean() are
+ * reported by is_dirty() so that only those need to be written.
+ */
+class Block_Bitmap {
+ public:
+  static const int BITS_PER_BLOCK = Disk::DISK_BLOCK_SIZE * 8;
+
+  Block_Bitmap(int nbits = 0);
+
+  int size() { return nbits; }
+
+  bool is_free(int bit) { return words[bit / 64] >> (bit % 64) & 1; }
+  void set_free(int bit);
+  void set_used(int bit);
+
+  /**
+   * Return the first free bit at or after from, or -1 if there is none.
+   */
+  int next_free(int from);
+
+  /**
+   * Find a free bit, mark it as used and return it, or -1 if all are used.
+   */
+  int allocate();
+
+  /**
+   * Return the start of a run of n contiguous free bits, or -1 if there is
+   * no such run. The bits are not marked as used.
+   */
+  int find_free_run(int n);
+
+  /**
+   * Return the number of contiguous free bits starting at bit, up to max.
+   */
+  int run_length(int bit, int max);
+
+  int count_free();
+
+  /**
+   * Number of disk blocks needed to store nbits bits.
+   */
+  static int blocks(int nbits) {
+    return (nbits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  }
+  int blocks() { return blocks(nbits); }
+
+  /**
+   * Copy the index-th on-disk block of the bitmap from or to data.
+   */
+  void load_block(int index, const char *data);
+  void store_block(int index, char *data);
+
+  bool is_dirty(int index) { return dirty[index]; }
+  void mark_dirty();
+  void mark_clean();
+
+ private:
+  static const int WORDS_PER_BLOCK = BITS_PER_BLOCK / 64;
+
+  int nbits;
+  int cursor;
+  vector<uint64_t> words;
+  vector<uint64_t> summary;
+  vector<char> dirty;
+
+  /**
+   * Recompute the summary bits of words first to last - 1.
+   */
+  void summarize(int first, int last);
+
+  /**
+   * Return the first word at or after word that has a free bit, or -1.
+   */
+  int next_word(int word);
+
+  /**
+   * Return the first free bit in [from, to), or -1.
+   */
+  int scan(int from, int to);
+};
+
+#endif
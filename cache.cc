@@ -0,0 +1,183 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+Block_Cache::Block_Cache(Disk *d, int c) {
+  disk = d;
+  capacity = max(c, 1);
+  holding = false;
+  held = 0;
+  nhits = 0;
+  nmisses = 0;
+  nevictions = 0;
+  nwritebacks = 0;
+
+  // Dirty blocks must reach the image before the disk goes away.
+  disk->add_close_hook([this]() {
+    flush();
+    report();
+  });
+}
+
+Block_Cache::frame &Block_Cache::lookup(int blocknum, bool fill) {
+  auto it = index.find(blocknum);
+  if (it != index.end()) {
+    nhits++;
+    frames.splice(frames.begin(), frames, it->second);
+    return frames.front();
+  }
+
+  nmisses++;
+
+  // Held frames cannot be evicted; if every frame is held the cache grows
+  // until they are released.
+  auto victim = frames.end();
+  if ((int)frames.size() >= capacity) {
+    victim = prev(frames.end());
+    while (victim->held && victim != frames.begin()) --victim;
+    if (victim->held) victim = frames.end();
+  }
+
+  if (victim == frames.end()) {
+    frames.emplace_front();
+  } else {
+    // Reuse the least recently used frame, writing it back if needed.
+    if (victim->dirty) {
+      disk->write(victim->blocknum, victim->data);
+      nwritebacks++;
+    }
+    index.erase(victim->blocknum);
+    nevictions++;
+    frames.splice(frames.begin(), frames, victim);
+  }
+
+  frame &f = frames.front();
+  f.blocknum = blocknum;
+  f.dirty = false;
+  f.held = false;
+  index[blocknum] = frames.begin();
+
+  if (fill) disk->read(blocknum, f.data);
+  return f;
+}
+
+void Block_Cache::read(int blocknum, char *data) {
+  // A mapped disk is already backed by the kernel page cache, so caching
+  // its blocks again would only add a copy.
+  if (disk->is_mapped()) return disk->read(blocknum, data);
+
+  lock_guard<mutex> lock(m);
+  frame &f = lookup(blocknum, true);
+  memcpy(data, f.data, Disk::DISK_BLOCK_SIZE);
+}
+
+void Block_Cache::write(int blocknum, const char *data) {
+  if (disk->is_mapped()) return disk->write(blocknum, data);
+
+  lock_guard<mutex> lock(m);
+
+  // The whole block is overwritten, so a miss does not need to read it first.
+  frame &f = lookup(blocknum, false);
+
+  // A dirty block that is not held was committed by the journal; that
+  // version must reach the disk before the block is held with newer
+  // contents, or a checkpoint would lose it.
+  if (holding && !f.held && f.dirty) {
+    disk->write(f.blocknum, f.data);
+    nwritebacks++;
+  }
+
+  memcpy(f.data, data, Disk::DISK_BLOCK_SIZE);
+  f.dirty = true;
+  if (holding && !f.held) {
+    f.held = true;
+    held++;
+  }
+}
+
+void Block_Cache::read_blocks(int start, int count, char *data) {
+  if (disk->is_mapped()) return disk->read_blocks(start, count, data);
+
+  lock_guard<mutex> lock(m);
+
+  int i = 0;
+  while (i < count) {
+    auto it = index.find(start + i);
+    if (it != index.end()) {
+      nhits++;
+      memcpy(data + i * Disk::DISK_BLOCK_SIZE, it->second->data,
+             Disk::DISK_BLOCK_SIZE);
+      i++;
+      continue;
+    }
+
+    int run = 1;
+    while (i + run < count && !index.count(start + i + run)) run++;
+
+    nmisses += run;
+    disk->read_blocks(start + i, run, data + i * Disk::DISK_BLOCK_SIZE);
+    i += run;
+  }
+}
+
+void Block_Cache::discard(int blocknum) {
+  lock_guard<mutex> lock(m);
+  auto it = index.find(blocknum);
+  if (it == index.end()) return;
+
+  if (it->second->held) held--;
+  frames.erase(it->second);
+  index.erase(it);
+}
+
+void Block_Cache::flush() {
+  lock_guard<mutex> lock(m);
+  // Write back in block order, one disk request per run of contiguous
+  // dirty blocks.
+  vector<frame *> dirty;
+  for (frame &f : frames)
+    if (f.dirty && !f.held) dirty.push_back(&f);
+
+  sort(dirty.begin(), dirty.end(),
+       [](frame *a, frame *b) { return a->blocknum < b->blocknum; });
+
+  vector<const char *> run;
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    run.push_back(dirty[i]->data);
+    dirty[i]->dirty = false;
+
+    bool last = i + 1 == dirty.size() ||
+                dirty[i + 1]->blocknum != dirty[i]->blocknum + 1;
+    if (last) {
+      disk->writev(dirty[i]->blocknum - run.size() + 1, run.size(),
+                   run.data());
+      nwritebacks += run.size();
+      run.clear();
+    }
+  }
+}
+
+vector<pair<int, const char *>> Block_Cache::held_blocks() {
+  lock_guard<mutex> lock(m);
+  vector<pair<int, const char *>> blocks;
+  for (frame &f : frames)
+    if (f.held) blocks.push_back({f.blocknum, f.data});
+  sort(blocks.begin(), blocks.end());
+  return blocks;
+}
+
+void Block_Cache::release_held() {
+  lock_guard<mutex> lock(m);
+  for (frame &f : frames) f.held = false;
+  held = 0;
+}
+
+void Block_Cache::report() {
+  cout << nhits << " cache hits\n";
+  cout << nmisses << " cache misses\n";
+  cout << nevictions << " cache evictions\n";
+  cout << nwritebacks << " cache write-backs\n";
+}
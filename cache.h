@@ -0,0 +1,120 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "disk.h"
+
+/**
+ * Write-back LRU cache of disk blocks. Every block transfer done by the file
+ * system goes through it, so repeated reads of the same inode or indirect
+ * block are served from memory and writes are only sent to the disk when the
+ * block is evicted or the cache is flushed.
+ *
+ * File data written by INE5412_FS::fs_write goes straight to the disk with
+ * asynchronous requests; such blocks must be dropped from the cache with
+ * discard() first so that a stale copy is never written back over them.
+ *
+ * While holding is on (see hold()), written blocks are held: they are
+ * neither evicted nor written back until release_held(). The metadata
+ * journal uses this to keep the blocks of an uncommitted transaction out of
+ * their home locations.
+ *
+ * The cache can be used from several threads at once: every call takes
+ * the cache's lock, and each call is done as a whole under it.
+ */
+class Block_Cache {
+ public:
+  static const int DEFAULT_CAPACITY = 64;
+
+  Block_Cache(Disk *d, int capacity = DEFAULT_CAPACITY);
+
+  void read(int blocknum, char *data);
+  void write(int blocknum, const char *data);
+
+  /**
+   * Read count contiguous blocks into data. Cached blocks are copied from
+   * memory and each run of uncached blocks is fetched with one disk request.
+   * Blocks read this way are not added to the cache, so a full scan does not
+   * push out the working set.
+   */
+  void read_blocks(int start, int count, char *data);
+
+  /**
+   * Forget blocknum without writing it back, if it is cached.
+   */
+  void discard(int blocknum);
+
+  /**
+   * Write every dirty block that is not held back to the disk. Blocks stay
+   * cached.
+   */
+  void flush();
+
+  /**
+   * Turn holding of written blocks on or off.
+   */
+  void hold(bool on) {
+    lock_guard<mutex> lock(m);
+    holding = on;
+  }
+
+  /**
+   * The held blocks, in block order, as (block number, contents) pairs. The
+   * pointers are valid until the next call that changes the cache.
+   */
+  vector<pair<int, const char *>> held_blocks();
+  int nheld() {
+    lock_guard<mutex> lock(m);
+    return held;
+  }
+
+  /**
+   * Let the held blocks be written back like any other dirty block.
+   */
+  void release_held();
+
+  /**
+   * Print the hit/miss/eviction counters.
+   */
+  void report();
+
+  int size() { return capacity; }
+
+ private:
+  struct frame {
+    int blocknum;
+    bool dirty;
+    bool held;
+    char data[Disk::DISK_BLOCK_SIZE];
+  };
+
+  Disk *disk;
+  int capacity;
+  mutex m;
+  bool holding;
+  int held;
+
+  // Most recently used frame at the front.
+  list<frame> frames;
+  unordered_map<int, list<frame>::iterator> index;
+
+  int nhits;
+  int nmisses;
+  int nevictions;
+  int nwritebacks;
+
+  /**
+   * Find the frame holding blocknum and move it to the front of the LRU
+   * list. If the block is not cached, take a frame (evicting the least
+   * recently used one that is not held, if the cache is full) and, if fill
+   * is set, read the block from disk into it.
+   */
+  frame &lookup(int blocknum, bool fill);
+};
+
+#endif
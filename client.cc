@@ -0,0 +1,278 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+using namespace std;
+using namespace Protocol;
+
+/**
+ * Client for the server started by the shell's serve command. Copies keep
+ * up to WINDOW requests of CHUNK bytes in flight on the connection.
+ */
+class FS_Client
+{
+public:
+    static const int WINDOW = 32;
+    static const int CHUNK = 65536;
+
+    bool open(const char *path);
+
+    /**
+     * Send one request and return its id.
+     */
+    uint32_t send_request(uint16_t op, int inumber, int offset, int length, const char *data = nullptr);
+
+    /**
+     * Wait for the next reply, storing the data that comes with it in data.
+     */
+    bool recv_reply(reply_header *reply, vector<char> *data);
+
+    /**
+     * Send one request and wait for its reply; return its result.
+     */
+    int call(uint16_t op, int inumber, vector<char> *data = nullptr);
+
+    int do_copyin(const char *filename, int inumber);
+    int do_copyout(int inumber, const char *filename);
+
+private:
+    int fd = -1;
+    uint32_t next_id = 1;
+};
+
+int main( int argc, char *argv[] )
+{
+	if(argc < 3) {
+		cout << "use: " << argv[0] << " <socket> <command> [args]\n";
+		cout << "commands are:\n";
+		cout << "    create\n";
+		cout << "    delete  <inode>\n";
+		cout << "    getsize <inode>\n";
+		cout << "    stat    <inode>\n";
+		cout << "    cat     <inode>\n";
+		cout << "    copyin  <file> <inode>\n";
+		cout << "    copyout <inode> <file>\n";
+		return 1;
+	}
+
+	FS_Client client;
+	if(!client.open(argv[1]))
+		return 1;
+
+	const char *cmd = argv[2];
+	int args = argc - 2;
+	int inumber, result;
+
+	if(!strcmp(cmd, "create") && args == 1) {
+		inumber = client.call(OP_CREATE, 0);
+		if(inumber > 0) {
+			cout << "created inode " << inumber << "\n";
+			return 0;
+		}
+		cout << "create failed!\n";
+	} else if(!strcmp(cmd, "delete") && args == 2) {
+		inumber = atoi(argv[3]);
+		if(client.call(OP_DELETE, inumber) > 0) {
+			cout << "inode " << inumber << " deleted.\n";
+			return 0;
+		}
+		cout << "delete failed!\n";
+	} else if(!strcmp(cmd, "getsize") && args == 2) {
+		inumber = atoi(argv[3]);
+		result = client.call(OP_GETSIZE, inumber);
+		if(result >= 0) {
+			cout << "inode " << inumber << " has size " << result << "\n";
+			return 0;
+		}
+		cout << "getsize failed!\n";
+	} else if(!strcmp(cmd, "stat") && args == 2) {
+		inumber = atoi(argv[3]);
+		vector<char> data;
+		if(client.call(OP_STAT, inumber, &data) > 0 && data.size() == sizeof(stat_reply)) {
+			stat_reply *s = (stat_reply *) data.data();
+			cout << "inode " << inumber << ": size " << s->size << ", " << s->blocks << " blocks, flags " << s->flags << "\n";
+			return 0;
+		}
+		cout << "stat failed!\n";
+	} else if(!strcmp(cmd, "cat") && args == 2) {
+		inumber = atoi(argv[3]);
+		if(client.do_copyout(inumber, "/dev/stdout"))
+			return 0;
+		cout << "cat failed!\n";
+	} else if(!strcmp(cmd, "copyin") && args == 3) {
+		inumber = atoi(argv[4]);
+		if(client.do_copyin(argv[3], inumber)) {
+			cout << "copied file " << argv[3] << " to inode " << inumber << "\n";
+			return 0;
+		}
+		cout << "copy failed!\n";
+	} else if(!strcmp(cmd, "copyout") && args == 3) {
+		inumber = atoi(argv[3]);
+		if(client.do_copyout(inumber, argv[4])) {
+			cout << "copied inode " << inumber << " to file " << argv[4] << "\n";
+			return 0;
+		}
+		cout << "copy failed!\n";
+	} else {
+		cout << "unknown command or wrong arguments: " << cmd << "\n";
+	}
+	return 1;
+}
+
+bool FS_Client::open(const char *path)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		cout << "socket path " << path << " is too long\n";
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+		cout << "couldn't connect to " << path << ": " << strerror(errno) << "\n";
+		return false;
+	}
+	return true;
+}
+
+uint32_t FS_Client::send_request(uint16_t op, int inumber, int offset, int length, const char *data)
+{
+	request_header req = {MAGIC, next_id++, op, 0, inumber, offset, length};
+	if(!send_all(fd, &req, sizeof(req)) || (op == OP_WRITE && !send_all(fd, data, length))) {
+		cout << "connection to the server lost\n";
+		exit(1);
+	}
+	return req.id;
+}
+
+bool FS_Client::recv_reply(reply_header *reply, vector<char> *data)
+{
+	if(!recv_all(fd, reply, sizeof(*reply)) || reply->magic != MAGIC || reply->length < 0)
+		return false;
+	data->resize(reply->length);
+	return recv_all(fd, data->data(), reply->length);
+}
+
+int FS_Client::call(uint16_t op, int inumber, vector<char> *data)
+{
+	reply_header reply;
+	vector<char> scratch;
+	send_request(op, inumber, 0, 0);
+	if(!recv_reply(&reply, data ? data : &scratch)) {
+		cout << "connection to the server lost\n";
+		exit(1);
+	}
+	return reply.result;
+}
+
+int FS_Client::do_copyin(const char *filename, int inumber)
+{
+	FILE *file;
+	int offset = 0, result, inFlight = 0;
+	bool failed = false, eof = false;
+	vector<char> buffer(CHUNK), data;
+	// Bytes each write in flight was sent with, by request id
+	map<uint32_t, int> sent;
+	reply_header reply;
+
+	file = fopen(filename, "r");
+	if(!file) {
+		cout << "couldn't open " << filename << "\n";
+		return 0;
+	}
+
+	// The server runs the writes of one inode in order, so the next one can
+	// be sent before the last one is answered
+	while(!eof || inFlight) {
+		if(!eof && !failed && inFlight < WINDOW) {
+			result = fread(buffer.data(), 1, CHUNK, file);
+			if(result <= 0) {
+				eof = true;
+				continue;
+			}
+			sent[send_request(OP_WRITE, inumber, offset, result, buffer.data())] = result;
+			offset += result;
+			inFlight++;
+			continue;
+		}
+		if(!inFlight)
+			break;
+
+		if(!recv_reply(&reply, &data)) {
+			cout << "connection to the server lost\n";
+			exit(1);
+		}
+		inFlight--;
+		if(reply.result != sent[reply.id] && !failed) {
+			cout << "WARNING: fs_write only wrote " << reply.result << " bytes, not " << sent[reply.id] << " bytes\n";
+			failed = true;
+		}
+		sent.erase(reply.id);
+	}
+
+	if(failed)
+		cout << "copy stopped early\n";
+	else
+		cout << offset << " bytes copied\n";
+
+	fclose(file);
+	return !failed;
+}
+
+int FS_Client::do_copyout(int inumber, const char *filename)
+{
+	FILE *file;
+	int size, offset = 0, copied = 0, inFlight = 0;
+	map<uint32_t, int> offsets;
+	vector<char> data;
+	reply_header reply;
+
+	size = call(OP_GETSIZE, inumber);
+	if(size < 0)
+		return 0;
+
+	file = fopen(filename, "w");
+	if(!file) {
+		cout << "couldn't open " << filename << "\n";
+		return 0;
+	}
+
+	while(offset < size || inFlight) {
+		if(offset < size && inFlight < WINDOW) {
+			offsets[send_request(OP_READ, inumber, offset, CHUNK)] = offset;
+			offset += CHUNK;
+			inFlight++;
+			continue;
+		}
+
+		if(!recv_reply(&reply, &data)) {
+			cout << "connection to the server lost\n";
+			exit(1);
+		}
+		inFlight--;
+		if(reply.result > 0) {
+			fseek(file, offsets[reply.id], SEEK_SET);
+			fwrite(data.data(), 1, reply.result, file);
+			copied += reply.result;
+		}
+		offsets.erase(reply.id);
+	}
+
+	cout << copied << " bytes copied\n";
+
+	fclose(file);
+	return 1;
+}
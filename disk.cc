@@ -1,19 +1,37 @@
 #include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-Disk::Disk(const char *filename, int n)
+Disk::Disk(const char *filename, int n, bool mapped)
 {
-	diskfile = fopen(filename, "r+");
+	mapping = 0;
+	aio = 0;
+	pending = 0;
+	fd = open(filename, O_RDWR | O_CREAT, 0666);
 
-	if(!diskfile) 
-		diskfile = fopen(filename, "w+");
-
-	if(!diskfile) { 
+	if(fd < 0) {
 		cout << "Error when opening the file " << filename << "\n";
 		return;
 	}
 
-	ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+	ftruncate(fd, (off_t) n * DISK_BLOCK_SIZE);
+
+	if(mapped && n > 0) {
+		void *addr = mmap(0, (size_t) n * DISK_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(addr == MAP_FAILED) {
+			cout << "Error when mapping the file " << filename << ", using read/write\n";
+		} else {
+			mapping = (char *) addr;
+		}
+	}
+
+	if(!mapping)
+		aio = Async_IO::create(fd, QUEUE_DEPTH);
 
     nblocks = n;
     nreads = 0;
@@ -43,42 +61,330 @@ void Disk::sanity_check( int blocknum, const void *data )
 	}
 }
 
+void Disk::sanity_check( int start, int count, const void *data )
+{
+	if(count < 0) {
+		cout << "ERROR: block count (" << count << ") is negative!\n";
+		abort();
+	}
+
+	sanity_check(start, data);
+	if(count > 0)
+		sanity_check(start + count - 1, data);
+}
+
+/*
+ * Move the whole of iov to or from the image starting at byte offset,
+ * retrying on short transfers. Returns false on an I/O error.
+ */
+bool Disk::transfer(bool to_disk, off_t offset, struct iovec *iov, int iovcnt)
+{
+	// Keep the order of transfers: anything still queued goes first.
+	drain();
+
+	if(mapping) {
+		for(int i = 0; i < iovcnt; i++) {
+			if(to_disk)
+				memcpy(mapping + offset, iov[i].iov_base, iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, mapping + offset, iov[i].iov_len);
+			offset += iov[i].iov_len;
+		}
+		return true;
+	}
+
+	while(iovcnt > 0) {
+		ssize_t n = to_disk ? pwritev(fd, iov, iovcnt, offset)
+		                    : preadv(fd, iov, iovcnt, offset);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+
+		offset += n;
+		while(iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
 void Disk::read(int blocknum, char *data )
 {
-	sanity_check(blocknum, data);
+	Op_Stats::scope timing(&op_stats, Op_Stats::DISK_READ);
+	timing.set_bytes(DISK_BLOCK_SIZE);
+	atomic<bool> finished(false);
+	submit_read(blocknum, data, [&finished]() { finished = true; });
+	while(!finished)
+		poll(true);
+}
+
+void Disk::write(int blocknum, const char *data)
+{
+	Op_Stats::scope timing(&op_stats, Op_Stats::DISK_WRITE);
+	timing.set_bytes(DISK_BLOCK_SIZE);
+	atomic<bool> finished(false);
+	submit_write(blocknum, data, [&finished]() { finished = true; });
+	while(!finished)
+		poll(true);
+}
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+/*
+ * What the disk keeps about a request while the engine works on it.
+ */
+struct disk_request {
+	Async_IO::request io;
+	int count;
+	function<void()> done;
+};
+
+void Disk::submit_read(int blocknum, char *data, function<void()> done)
+{
+	submit(false, blocknum, 1, data, done);
+}
+
+void Disk::submit_write(int blocknum, const char *data, function<void()> done)
+{
+	submit(true, blocknum, 1, (char *) data, done);
+}
+
+void Disk::submit_read_blocks(int start, int count, char *data, function<void()> done)
+{
+	submit(false, start, count, data, done);
+}
+
+void Disk::submit_write_blocks(int start, int count, const char *data, function<void()> done)
+{
+	submit(true, start, count, (char *) data, done);
+}
+
+void Disk::submit(bool write, int start, int count, char *data, function<void()> done)
+{
+	sanity_check(start, count, data);
+
+	if(mapping) {
+		char *block = mapping + (size_t) start * DISK_BLOCK_SIZE;
+		if(write) {
+			memcpy(block, data, (size_t) count * DISK_BLOCK_SIZE);
+			nwrites += count;
+		} else {
+			memcpy(data, block, (size_t) count * DISK_BLOCK_SIZE);
+			nreads += count;
+		}
+		op_stats.count_blocks(write, count);
+		if(done)
+			done();
+		return;
+	}
+
+	disk_request *r = new disk_request;
+	r->io.write = write;
+	r->io.offset = (off_t) start * DISK_BLOCK_SIZE;
+	r->io.iov.iov_base = data;
+	r->io.iov.iov_len = (size_t) count * DISK_BLOCK_SIZE;
+	r->io.owner = r;
+	r->count = count;
+	r->done = done;
+
+	// Charged here, in the thread of the operation that wants the blocks,
+	// rather than in whichever thread reaps the request
+	op_stats.count_blocks(write, count);
+
+	while(true) {
+		{
+			lock_guard<mutex> lock(submit_lock);
+			if(pending < QUEUE_DEPTH) {
+				pending++;
+				aio->submit(&r->io);
+				return;
+			}
+		}
+		poll(true);
+	}
+}
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+int Disk::poll(bool wait)
+{
+	Async_IO::request *finished[QUEUE_DEPTH];
+	int ncompleted = 0;
+
+	// Only one thread reaps at a time, so a waiting reap always has one of
+	// the pending requests still to come.
+	lock_guard<mutex> lock(reap_lock);
+	if(!pending)
+		return 0;
+
+	int n = aio->reap(finished, QUEUE_DEPTH, wait);
+	for(int i = 0; i < n; i++) {
+		disk_request *r = (disk_request *) finished[i]->owner;
+		ssize_t result = r->io.result;
+
+		if(result <= 0) {
+			cout << "ERROR: couldn't access simulated disk\n";
+			abort();
+		}
+
+		// Short transfer: send the rest of the block again.
+		if((size_t) result < r->io.iov.iov_len) {
+			r->io.offset += result;
+			r->io.iov.iov_base = (char *) r->io.iov.iov_base + result;
+			r->io.iov.iov_len -= result;
+			lock_guard<mutex> resubmit(submit_lock);
+			aio->submit(&r->io);
+			continue;
+		}
+
+		if(r->io.write)
+			nwrites += r->count;
+		else
+			nreads += r->count;
+
+		// The request counts as pending until done has run, so that its
+		// submitter never sees an empty queue before it is told.
+		if(r->done)
+			r->done();
+		pending--;
+		ncompleted++;
+		delete r;
+	}
+	return ncompleted;
+}
+
+void Disk::drain()
+{
+	while(pending > 0)
+		poll(true);
+}
+
+void Disk::read_blocks(int start, int count, char *data)
+{
+	sanity_check(start, count, data);
+
+	struct iovec iov = { data, (size_t) count * DISK_BLOCK_SIZE };
+
+	if(transfer(false, (off_t) start * DISK_BLOCK_SIZE, &iov, 1)) {
+		nreads += count;
+		op_stats.count_blocks(false, count);
 	} else {
 		cout << "ERROR: couldn't access simulated disk\n";
 		abort();
 	}
 }
 
-void Disk::write(int blocknum, const char *data)
+void Disk::write_blocks(int start, int count, const char *data)
 {
-	sanity_check(blocknum, data);
+	sanity_check(start, count, data);
 
-    fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	struct iovec iov = { (void *) data, (size_t) count * DISK_BLOCK_SIZE };
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(transfer(true, (off_t) start * DISK_BLOCK_SIZE, &iov, 1)) {
+		nwrites += count;
+		op_stats.count_blocks(true, count);
 	} else {
 		cout << "ERROR: couldn't access simulated disk\n";
 		abort();
 	}
-	
+}
+
+void Disk::readv(int start, int count, char *const *blocks)
+{
+	sanity_check(start, count, blocks);
+
+	struct iovec iov[IOV_MAX];
+
+	for(int done = 0; done < count; ) {
+		int n = min(count - done, IOV_MAX);
+		for(int i = 0; i < n; i++) {
+			sanity_check(start + done + i, blocks[done + i]);
+			iov[i].iov_base = blocks[done + i];
+			iov[i].iov_len = DISK_BLOCK_SIZE;
+		}
+
+		if(!transfer(false, (off_t) (start + done) * DISK_BLOCK_SIZE, iov, n)) {
+			cout << "ERROR: couldn't access simulated disk\n";
+			abort();
+		}
+		nreads += n;
+		op_stats.count_blocks(false, n);
+		done += n;
+	}
+}
+
+void Disk::writev(int start, int count, const char *const *blocks)
+{
+	sanity_check(start, count, blocks);
+
+	struct iovec iov[IOV_MAX];
+
+	for(int done = 0; done < count; ) {
+		int n = min(count - done, IOV_MAX);
+		for(int i = 0; i < n; i++) {
+			sanity_check(start + done + i, blocks[done + i]);
+			iov[i].iov_base = (void *) blocks[done + i];
+			iov[i].iov_len = DISK_BLOCK_SIZE;
+		}
+
+		if(!transfer(true, (off_t) (start + done) * DISK_BLOCK_SIZE, iov, n)) {
+			cout << "ERROR: couldn't access simulated disk\n";
+			abort();
+		}
+		nwrites += n;
+		op_stats.count_blocks(true, n);
+		done += n;
+	}
+}
+
+char *Disk::map(int blocknum)
+{
+	if(!mapping)
+		return 0;
+
+	sanity_check(blocknum, mapping);
+	nreads++;
+	op_stats.count_blocks(false, 1);
+	return mapping + (size_t) blocknum * DISK_BLOCK_SIZE;
+}
+
+void Disk::sync()
+{
+	drain();
+	if(mapping)
+		msync(mapping, (size_t) nblocks * DISK_BLOCK_SIZE, MS_SYNC);
+	else
+		fdatasync(fd);
+}
+
+void Disk::add_close_hook(function<void()> hook)
+{
+	close_hooks.push_back(hook);
 }
 
 void Disk::close()
 {
-	if(diskfile) {
+	if(fd >= 0) {
+		drain();
+		for(auto hook = close_hooks.rbegin(); hook != close_hooks.rend(); ++hook)
+			(*hook)();
+		close_hooks.clear();
+
 		cout << nreads << " disk block reads\n";
 		cout << nwrites << " disk block writes\n";
-		fclose(diskfile);
-		diskfile = 0;
+		op_stats.close();
+
+		if(mapping) {
+			sync();
+			munmap(mapping, (size_t) nblocks * DISK_BLOCK_SIZE);
+			mapping = 0;
+		}
+		delete aio;
+		aio = 0;
+		::close(fd);
+		fd = -1;
 	}
 }
-
@@ -1,9 +1,18 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include "aio.h"
+#include "stats.h"
 
 using namespace std;
 
@@ -12,22 +21,119 @@ class Disk
 public:
     static const unsigned short int DISK_BLOCK_SIZE = 4096;
     static const unsigned int DISK_MAGIC = 0xdeadbeef;
+    static const int QUEUE_DEPTH = 32;
 
-    Disk(const char *filename, int nblocks);
+    Disk(const char *filename, int nblocks, bool mapped = false);
 
     int size();
     void read(int blocknum, char * data);
     void write(int blocknum, const char * data);
+
+    /**
+     * Transfer count contiguous blocks starting at start in a single
+     * system call, to or from one contiguous buffer. While no asynchronous
+     * request is in flight these and the vectored versions below are safe
+     * to call from several threads.
+     */
+    void read_blocks(int start, int count, char *data);
+    void write_blocks(int start, int count, const char *data);
+
+    /**
+     * Scatter/gather versions: block start + i is transferred to or from
+     * blocks[i], which need not be contiguous in memory.
+     */
+    void readv(int start, int count, char *const *blocks);
+    void writev(int start, int count, const char *const *blocks);
+
+    /**
+     * Asynchronous single-block transfers. The request is queued and done is
+     * called from poll() once the block has been transferred, so data must
+     * stay valid until then. Any thread may submit and poll; done runs in
+     * whichever thread reaps the request, so what it touches must be safe to
+     * change from another thread (an atomic flag or counter). At most
+     * QUEUE_DEPTH requests are in flight; submitting another one first waits
+     * for an earlier one to finish. On a mapped disk the copy is made right
+     * away and done is called before returning.
+     */
+    void submit_read(int blocknum, char *data, function<void()> done = nullptr);
+    void submit_write(int blocknum, const char *data, function<void()> done = nullptr);
+
+    /**
+     * Asynchronous transfer of count contiguous blocks starting at start,
+     * to or from one contiguous buffer, as a single request.
+     */
+    void submit_read_blocks(int start, int count, char *data, function<void()> done = nullptr);
+    void submit_write_blocks(int start, int count, const char *data, function<void()> done = nullptr);
+
+    /**
+     * Run the callbacks of finished requests and return how many there were.
+     * If wait is set and requests are in flight, block until one finishes.
+     */
+    int poll(bool wait = false);
+
+    /**
+     * Wait until every submitted request has finished.
+     */
+    void drain();
+
+    int in_flight() { return pending; }
+
+    /**
+     * Blocks read and written since the disk was opened.
+     */
+    int reads() { return nreads; }
+    int writes() { return nwrites; }
+
+    /**
+     * Per-operation statistics; the disk charges every block it transfers
+     * to them.
+     */
+    Op_Stats *stats() { return &op_stats; }
+
+    /**
+     * In mapped mode, return a pointer to blocknum inside the memory
+     * mapping of the image, counted as a block read. Returns null when the
+     * disk was opened without mapping.
+     */
+    char *map(int blocknum);
+    bool is_mapped() { return mapping != 0; }
+
+    /**
+     * Force everything written so far to stable storage (msync on a mapped
+     * disk, fdatasync otherwise).
+     */
+    void sync();
+
     void close();
 
+    /**
+     * Register a function to run when the disk is closed, before the
+     * block counters are printed. Hooks run in reverse order of registration.
+     */
+    void add_close_hook(function<void()> hook);
+
 private:
     void sanity_check(int blocknum, const void *data);
+    void sanity_check(int start, int count, const void *data);
+    bool transfer(bool to_disk, off_t offset, struct iovec *iov, int iovcnt);
+    void submit(bool write, int start, int count, char *data, function<void()> done);
 
 private:
-    FILE *diskfile;
+    int fd;
+    char *mapping;
+    Async_IO *aio;
+    // Submission and completion are locked separately, so that a thread
+    // waiting for a completion does not stop others from submitting.
+    mutex submit_lock;
+    mutex reap_lock;
+    atomic<int> pending;
     int nblocks;
-    int nreads;
-    int nwrites;
+    // Counted atomically: the contiguous and vectored transfers may be made
+    // from several threads at once while nothing is queued.
+    atomic<int> nreads;
+    atomic<int> nwrites;
+    vector<function<void()>> close_hooks;
+    Op_Stats op_stats;
 };
 
 
@@ -2,8 +2,16 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+#include "lz.h"
 
 int INE5412_FS::fs_format() {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_FORMAT);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::FORMAT);
+  unique_lock<shared_mutex> lock(op_lock);
   // Check if the file system is already mounted
   if (mounted) {
     cout
@@ -15,33 +23,84 @@ int INE5412_FS::fs_format() {
   int total_blocks = disk->size();
   int inode_blocks = static_cast<int>(ceil(total_blocks * 0.1));
 
-  // Reserving ten percent of blocks to inodes
+  // Reserving ten percent of blocks to inodes, whose size the version sets
+  superblock.version = FS_VERSION;
   superblock.ninodeblocks = inode_blocks;
-  superblock.ninodes = inode_blocks * INODES_PER_BLOCK;
+  superblock.ninodes = inode_blocks * inodes_per_block();
+
+  // Followed by the free block and free inode bitmaps
+  superblock.bitmapstart = inode_blocks + 1;
+  superblock.nbitmapblocks = Block_Bitmap::blocks(total_blocks);
+  superblock.ninodebitmapblocks = Block_Bitmap::blocks(superblock.ninodes);
+
+  // And by the metadata journal
+  superblock.journalstart = superblock.bitmapstart + superblock.nbitmapblocks +
+                            superblock.ninodebitmapblocks;
+  superblock.njournalblocks = Journal::blocks_for(total_blocks);
+  if (superblock.njournalblocks)
+    journal.format(superblock.journalstart, superblock.njournalblocks);
+
+  // Nothing read before formatting is valid anymore
+  readahead.clear();
 
   // Freeing the inode table
   for (int i = 1; i <= inode_blocks; ++i) {
     fs_block inode_block;
-    for (int j = 0; j < INODES_PER_BLOCK; ++j) {
-      inode_block.inode[j].isvalid = false;
+    for (int j = 0; j < inodes_per_block(); ++j) {
+      block_inode(&inode_block, j)->isvalid = false;
     }
-    disk->write(i, inode_block.data);
+    cache.write(i, inode_block.data);
   }
 
+  // Writing the bitmaps: only the superblock, inode table and bitmaps
+  // themselves are used, and so are no inodes
+  superblock.nblocks = total_blocks;
+  free_blocks = Block_Bitmap(total_blocks);
+  for (int i = 0; i < first_data_block(); ++i) free_blocks.set_used(i);
+  free_inodes = Block_Bitmap(superblock.ninodes);
+  flush_bitmaps();
+  free_blocks = Block_Bitmap();
+  free_inodes = Block_Bitmap();
+
   // Writing the superblock
   superblock.magic = FS_MAGIC;
-  superblock.nblocks = total_blocks;
-  fs_block new_superblock;
-  new_superblock.super = superblock;
-  disk->write(0, new_superblock.data);
+  superblock.clean = FS_CLEAN;
+  write_superblock();
 
+  traced.set_result(1);
   return 1;  // Return success
 }
 
+void INE5412_FS::write_superblock() {
+  // Zero the rest of the block, so that fields added later read as zero
+  fs_block block;
+  memset(block.data, 0, sizeof(block.data));
+  block.super = superblock;
+  cache.write(0, block.data);
+}
+
+void INE5412_FS::write_clean_state(int clean) {
+  superblock.clean = clean;
+  fs_block block;
+  memset(block.data, 0, sizeof(block.data));
+  block.super = superblock;
+  cache.discard(0);
+  disk->write(0, block.data);
+  disk->sync();
+}
+
+int INE5412_FS::first_data_block() {
+  if (superblock.version < 1) return superblock.ninodeblocks + 1;
+  return superblock.bitmapstart + superblock.nbitmapblocks +
+         superblock.ninodebitmapblocks + superblock.njournalblocks;
+}
+
 void INE5412_FS::fs_debug() {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_DEBUG);
+  unique_lock<shared_mutex> lock(op_lock);
   union fs_block block;
 
-  disk->read(0, block.data);
+  cache.read(0, block.data);
 
   const string spaces = "    ";
   cout << "superblock:\n";
@@ -54,54 +113,173 @@ void INE5412_FS::fs_debug() {
 
   if (mounted) {
     cout << '\n' << "free blocks: ";
-    for (size_t i = 0; i < free_blocks.size(); ++i)
-      if (free_blocks[i]) cout << i << ' ';
+    for (int i = free_blocks.next_free(0); i >= 0;
+         i = free_blocks.next_free(i + 1))
+      cout << i << ' ';
     cout << '\n';
   }
 
-  for (int i = 1; i <= this->superblock.ninodeblocks; ++i) {
-    fs_block block = this->read_block(i);
+  // The inode table on disk is only current once changed inodes are written
+  // and the cache is flushed; the inode blocks are then read by several
+  // threads at once, INODE_SCAN_BLOCKS blocks per thread per round, and
+  // printed in order.
+  if (mounted && journal.running())
+    commit_metadata();
+  else if (mounted)
+    flush_inodes();
+  cache.flush();
+
+  int window = MAX_SCAN_THREADS * INODE_SCAN_BLOCKS;
+  for (int first = 1; first <= superblock.ninodeblocks; first += window) {
+    int last = min(first + window - 1, (int)superblock.ninodeblocks);
+    vector<string> text(last - first + 1);
+
+    parallel_scan(first, last, [&](int, int from, int to) {
+      for (int i = from; i <= to; ++i) {
+        fs_block buffer;
+        ostringstream out;
+        debug_inode_block(i, read_block_direct(i, &buffer), out);
+        text[i - first] = out.str();
+      }
+    });
+
+    for (const string &t : text) cout << t;
+  }
+}
+
+void INE5412_FS::debug_inode_block(int blocknum, const fs_block *block,
+                                   ostream &out) {
+  const string spaces = "    ";
 
-    for (int j = 0; j < this->INODES_PER_BLOCK; ++j) {
-      fs_inode inode = block.inode[j];
+  for (int j = 0; j < inodes_per_block(); ++j) {
+    fs_inode inode = *block_inode(block, j);
 
-      if (!inode.isvalid) continue;
+    if (!inode.isvalid) continue;
 
-      cout << "inode " << (i - 1) * INODES_PER_BLOCK + j + 1 << ":\n"
-           << spaces << "size: " << inode.size << " bytes\n"
-           << spaces << "direct blocks: ";
+    out << "inode " << (blocknum - 1) * inodes_per_block() + j + 1 << ":\n"
+        << spaces << "size: " << inode.size << " bytes\n";
 
-      bool has_direct_block = false;
-      for (int k = 0; k < this->POINTERS_PER_INODE; ++k) {
-        if (inode.direct[k]) {
-          cout << inode.direct[k] << ' ';
-          has_direct_block = true;
-        }
+    if (is_inline(&inode)) {
+      out << spaces << "data: inline\n";
+      continue;
+    }
+    if (is_compressed(&inode))
+      out << spaces << "data: compressed in " << CLUSTER_BLOCKS
+          << "-block clusters\n";
+
+    if (uses_extents(&inode)) {
+      fs_block extent_buffer;
+      const fs_extent *more = nullptr;
+      if (inode.indirect)
+        more = read_block_direct(inode.indirect, &extent_buffer)->extents;
+
+      out << spaces << "extents: ";
+      int nextents =
+          min(inode.nextents, more ? INLINE_EXTENTS + EXTENTS_PER_BLOCK
+                                   : (int)INLINE_EXTENTS);
+      for (int e = 0; e < nextents; ++e) {
+        const fs_extent &x = get_extent(inode, more, e);
+        if (!x.start)
+          out << "hole(" << x.length << ") ";
+        else
+          out << x.start << '-' << x.start + x.length - 1 << ' ';
       }
+      if (!nextents) out << '-';
 
-      if (!has_direct_block) cout << '-';
+      out << "\n"
+          << spaces << "extent block: "
+          << ((inode.indirect) ? to_string(inode.indirect) : "-") << "\n";
+      continue;
+    }
 
-      cout << "\n"
-           << spaces << "indirect block: "
-           << ((inode.indirect) ? to_string(inode.indirect) : "-") << "\n"
-           << spaces << "indirect data blocks: ";
+    out << spaces << "direct blocks: ";
 
-      if (!inode.indirect) {
-        cout << "-\n";
-        continue;
+    int ndirect = is_multilevel(&inode) ? POINTERS_PER_INODE - 2
+                                        : POINTERS_PER_INODE;
+    bool has_direct_block = false;
+    for (int k = 0; k < ndirect; ++k) {
+      if (inode.direct[k]) {
+        out << inode.direct[k] << ' ';
+        has_direct_block = true;
       }
+    }
 
-      fs_block indirect_block = this->read_block(inode.indirect);
-
-      for (int k = 0; k < this->POINTERS_PER_BLOCK; ++k)
-        if (indirect_block.pointers[k])
-          cout << indirect_block.pointers[k] << ' ';
-      cout << '\n';
+    if (!has_direct_block) out << '-';
+
+    out << "\n"
+        << spaces << "indirect block: "
+        << ((inode.indirect) ? to_string(inode.indirect) : "-") << "\n"
+        << spaces << "indirect data blocks: ";
+
+    if (inode.indirect)
+      debug_map_tree(inode.indirect, 1, out);
+    else
+      out << '-';
+    out << '\n';
+
+    if (!is_multilevel(&inode)) continue;
+
+    const char *names[] = {"double", "triple"};
+    int roots[] = {inode.double_indirect, inode.triple_indirect};
+    for (int level = 0; level < 2; ++level) {
+      out << spaces << names[level] << " indirect block: "
+          << (roots[level] ? to_string(roots[level]) : "-") << "\n"
+          << spaces << names[level] << " indirect data blocks: ";
+      if (roots[level])
+        debug_map_tree(roots[level], level + 2, out);
+      else
+        out << '-';
+      out << '\n';
     }
   }
 }
 
+void INE5412_FS::debug_map_tree(int blocknum, int depth, ostream &out) {
+  fs_block buffer;
+  const fs_block *block = read_block_direct(blocknum, &buffer);
+  for (int k = 0; k < POINTERS_PER_BLOCK; ++k) {
+    if (!block->pointers[k]) continue;
+    if (depth == 1)
+      out << block->pointers[k] << ' ';
+    else
+      debug_map_tree(block->pointers[k], depth - 1, out);
+  }
+}
+
+const INE5412_FS::fs_block *INE5412_FS::read_block_direct(
+    int blocknum, INE5412_FS::fs_block *buffer) {
+  if (char *mapped = disk->map(blocknum)) return (const fs_block *)mapped;
+  disk->read_blocks(blocknum, 1, buffer->data);
+  return buffer;
+}
+
+int INE5412_FS::parallel_scan(int first, int last,
+                              function<void(int, int, int)> work) {
+  // Small tables are not worth a thread; otherwise give each thread at least
+  // INODE_SCAN_BLOCKS blocks.
+  int nblocks = last - first + 1;
+  int nthreads = min({(int)MAX_SCAN_THREADS,
+                      (int)max(thread::hardware_concurrency(), 1u),
+                      (nblocks + INODE_SCAN_BLOCKS - 1) / INODE_SCAN_BLOCKS});
+  if (nthreads <= 1) {
+    work(0, first, last);
+    return 1;
+  }
+
+  vector<thread> threads;
+  for (int t = 0; t < nthreads; ++t) {
+    int from = first + (long)nblocks * t / nthreads;
+    int to = first + (long)nblocks * (t + 1) / nthreads - 1;
+    threads.emplace_back(work, t, from, to);
+  }
+  for (thread &t : threads) t.join();
+  return nthreads;
+}
+
 int INE5412_FS::fs_mount() {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_MOUNT);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::MOUNT);
+  unique_lock<shared_mutex> lock(op_lock);
   if (mounted) {
     cout << "Error: File system is already mounted.\n";
     return 0;  // Return failure
@@ -109,7 +287,7 @@ int INE5412_FS::fs_mount() {
 
   // Read the superblock from disk
   fs_block superblock_block;
-  disk->read(0, superblock_block.data);
+  cache.read(0, superblock_block.data);
   superblock = superblock_block.super;
 
   // Check if the magic number is valid
@@ -118,57 +296,373 @@ int INE5412_FS::fs_mount() {
     return 0;  // Return failure
   }
 
-  // Build a bitmap of free blocks
-  free_blocks.assign(superblock.nblocks,
-                     true);  // Assume all blocks are ionitially free
+  if (superblock.version > FS_VERSION) {
+    cout << "Error: File system version " << superblock.version
+         << " is not supported.\n";
+    return 0;  // Return failure
+  }
 
-  // Mark superblock and inode blocks as used
-  for (int i = 0; i <= superblock.ninodeblocks; ++i) {
-    free_blocks[i] = false;
+  inode_table.assign(superblock.ninodes, fs_inode());
+  inline_tails.assign(
+      has_large_inodes() ? (size_t)superblock.ninodes * INLINE_TAIL_SIZE : 0,
+      0);
+  inode_block_loaded = vector<atomic<bool>>(superblock.ninodeblocks + 1);
+  for (auto &loaded : inode_block_loaded) loaded = false;
+  dirty_inode_blocks.clear();
+
+  // Trust the bitmaps on disk only if they were written by a clean unmount,
+  // or by the last journal commit once the journal has been replayed;
+  // otherwise rebuild them from the inodes.
+  bool scanned = false;
+  if (superblock.version >= 1 && superblock.clean == FS_CLEAN) {
+    load_bitmaps();
+  } else if (superblock.version >= 4 && superblock.clean == FS_JOURNALED) {
+    int n = journal.replay(superblock.journalstart, superblock.njournalblocks);
+    if (n) cout << "replayed " << n << " journal transactions\n";
+    load_bitmaps();
+  } else {
+    scan_inodes();
+    scanned = true;
   }
 
-  // Mark data blocks used by valid inodes
-  for (int i = 1; i <= superblock.ninodeblocks; ++i) {
-    fs_block inode_block = read_block(i);
-    for (int j = 0; j < INODES_PER_BLOCK; ++j) {
-      fs_inode inode = inode_block.inode[j];
-      if (inode.isvalid) {
-        for (int k = 0; k < POINTERS_PER_INODE; ++k)
-          if (inode.direct[k]) free_blocks[inode.direct[k]] = false;
+  // The cache cannot hold blocks back from a mapped disk, so metadata is
+  // journaled only on disks opened without mapping.
+  bool journaled = superblock.version >= 4 && superblock.njournalblocks &&
+                   !disk->is_mapped();
+
+  // Until fs_umount writes the bitmaps back, the ones on disk are stale,
+  // unless the journal keeps them current. A journaled mount trusts them
+  // after a crash, so rebuilt ones are written first.
+  if (superblock.version >= 1) {
+    if (scanned && journaled) {
+      free_blocks.mark_dirty();
+      free_inodes.mark_dirty();
+      flush_bitmaps();
+    }
+    superblock.clean = journaled ? FS_JOURNALED : FS_DIRTY;
+    write_superblock();
+    cache.flush();
+    disk->sync();
+  }
+
+  if (journaled)
+    journal.start(superblock.journalstart, superblock.njournalblocks);
+
+  mounted = true;
+  traced.set_result(1);
+  return 1;  // Return success
+}
+
+void INE5412_FS::load_bitmaps() {
+  fs_block block;
 
-        if (inode.indirect) {
-          free_blocks[inode.indirect] = false;
-          fs_block indirect_block = read_block(inode.indirect);
-          for (int k = 0; k < POINTERS_PER_BLOCK; ++k) {
-            if (indirect_block.pointers[k]) {
-              free_blocks[indirect_block.pointers[k]] = false;
+  free_blocks = Block_Bitmap(superblock.nblocks);
+  for (int i = 0; i < superblock.nbitmapblocks; ++i) {
+    cache.read(superblock.bitmapstart + i, block.data);
+    free_blocks.load_block(i, block.data);
+  }
+
+  free_inodes = Block_Bitmap(superblock.ninodes);
+  int inodebitmapstart = superblock.bitmapstart + superblock.nbitmapblocks;
+  for (int i = 0; i < superblock.ninodebitmapblocks; ++i) {
+    cache.read(inodebitmapstart + i, block.data);
+    free_inodes.load_block(i, block.data);
+  }
+}
+
+void INE5412_FS::flush_bitmaps() {
+  // Disks without bitmaps keep them in memory only
+  if (superblock.version < 1) return;
+
+  fs_block block;
+  for (int i = 0; i < free_blocks.blocks(); ++i) {
+    if (!free_blocks.is_dirty(i)) continue;
+    free_blocks.store_block(i, block.data);
+    cache.write(superblock.bitmapstart + i, block.data);
+  }
+  free_blocks.mark_clean();
+
+  int inodebitmapstart = superblock.bitmapstart + superblock.nbitmapblocks;
+  for (int i = 0; i < free_inodes.blocks(); ++i) {
+    if (!free_inodes.is_dirty(i)) continue;
+    free_inodes.store_block(i, block.data);
+    cache.write(inodebitmapstart + i, block.data);
+  }
+  free_inodes.mark_clean();
+}
+
+void INE5412_FS::load_inode_block(int blocknum, const fs_block *block) {
+  int first = (blocknum - 1) * inodes_per_block();
+  if (has_large_inodes()) {
+    for (int j = 0; j < LARGE_INODES_PER_BLOCK; ++j) {
+      inode_table[first + j] = block->large_inode[j].inode;
+      memcpy(inline_tail(&inode_table[first + j]),
+             block->large_inode[j].inline_tail, INLINE_TAIL_SIZE);
+    }
+  } else {
+    copy(begin(block->inode), end(block->inode), inode_table.begin() + first);
+  }
+  inode_block_loaded[blocknum] = true;
+}
+
+void INE5412_FS::store_inode_block(int blocknum, fs_block *block) {
+  int first = (blocknum - 1) * inodes_per_block();
+  if (has_large_inodes()) {
+    for (int j = 0; j < LARGE_INODES_PER_BLOCK; ++j) {
+      block->large_inode[j].inode = inode_table[first + j];
+      memcpy(block->large_inode[j].inline_tail,
+             inline_tail(&inode_table[first + j]), INLINE_TAIL_SIZE);
+    }
+  } else {
+    copy(inode_table.begin() + first,
+         inode_table.begin() + first + INODES_PER_BLOCK, block->inode);
+  }
+}
+
+void INE5412_FS::scan_inodes() {
+  // The threads read the disk directly, so it has to be current
+  cache.flush();
+
+  int first_data = first_data_block();
+  int nwords = (superblock.nblocks + 63) / 64;
+
+  // What each thread found: the blocks its inodes point to, one bit per
+  // block, blocks it saw more than once and pointers outside the data area
+  // as (inumber, pointer).
+  struct partial_scan {
+    vector<uint64_t> used;
+    vector<int> duplicates;
+    vector<pair<int, int>> invalid;
+  };
+  vector<partial_scan> partial(MAX_SCAN_THREADS);
+
+  int nthreads = parallel_scan(
+      1, superblock.ninodeblocks, [&](int t, int from, int to) {
+        partial_scan &p = partial[t];
+        p.used.assign(nwords, 0);
+
+        auto use = [&](int inumber, int blocknum) {
+          if (blocknum < first_data || blocknum >= superblock.nblocks) {
+            p.invalid.push_back({inumber, blocknum});
+            return false;
+          }
+          uint64_t bit = 1ULL << (blocknum % 64);
+          if (p.used[blocknum / 64] & bit) p.duplicates.push_back(blocknum);
+          p.used[blocknum / 64] |= bit;
+          return true;
+        };
+
+        // Mark a mapping block depth levels above the data and everything
+        // under it.
+        function<void(int, int, int)> use_tree = [&](int inumber,
+                                                     int blocknum,
+                                                     int depth) {
+          if (!use(inumber, blocknum) || !depth) return;
+          fs_block buffer;
+          const fs_block *block = read_block_direct(blocknum, &buffer);
+          for (int k = 0; k < POINTERS_PER_BLOCK; ++k)
+            if (block->pointers[k])
+              use_tree(inumber, block->pointers[k], depth - 1);
+        };
+
+        // Copy the inode table and mark data blocks used by valid inodes.
+        // The inode table is contiguous on disk, so it is read
+        // INODE_SCAN_BLOCKS blocks per disk request.
+        vector<fs_block> inode_blocks(INODE_SCAN_BLOCKS);
+        for (int first = from; first <= to; first += INODE_SCAN_BLOCKS) {
+          int count = min((int)INODE_SCAN_BLOCKS, to - first + 1);
+          disk->read_blocks(first, count, inode_blocks[0].data);
+
+          for (int i = 0; i < count; ++i) {
+            load_inode_block(first + i, &inode_blocks[i]);
+
+            for (int j = 0; j < inodes_per_block(); ++j) {
+              fs_inode inode = *block_inode(&inode_blocks[i], j);
+              if (!inode.isvalid) continue;
+              int inumber = (first + i - 1) * inodes_per_block() + j + 1;
+
+              if (is_inline(&inode)) continue;  // no blocks
+              if (uses_extents(&inode)) {
+                fs_block buffer;
+                const fs_extent *more = nullptr;
+                if (inode.indirect && use(inumber, inode.indirect))
+                  more = read_block_direct(inode.indirect, &buffer)->extents;
+
+                int nextents = min(inode.nextents,
+                                   more ? INLINE_EXTENTS + EXTENTS_PER_BLOCK
+                                        : (int)INLINE_EXTENTS);
+                for (int e = 0; e < nextents; ++e) {
+                  const fs_extent &x = get_extent(inode, more, e);
+                  if (!x.start) continue;  // a hole
+                  for (int k = 0; k < x.length; ++k)
+                    if (!use(inumber, x.start + k)) break;
+                }
+                continue;
+              }
+
+              int ndirect = is_multilevel(&inode) ? POINTERS_PER_INODE - 2
+                                                  : POINTERS_PER_INODE;
+              for (int k = 0; k < ndirect; ++k)
+                if (inode.direct[k]) use(inumber, inode.direct[k]);
+
+              if (inode.indirect) use_tree(inumber, inode.indirect, 1);
+              if (is_multilevel(&inode)) {
+                if (inode.double_indirect)
+                  use_tree(inumber, inode.double_indirect, 2);
+                if (inode.triple_indirect)
+                  use_tree(inumber, inode.triple_indirect, 3);
+              }
             }
           }
         }
-      }
+      });
+
+  // Merge the partial maps; a block already set by an earlier thread is used
+  // more than once.
+  vector<uint64_t> used(nwords, 0);
+  vector<int> duplicates;
+  vector<pair<int, int>> invalid;
+  for (int t = 0; t < nthreads; ++t) {
+    partial_scan &p = partial[t];
+    for (int w = 0; w < nwords; ++w) {
+      for (uint64_t both = used[w] & p.used[w]; both; both &= both - 1)
+        duplicates.push_back(w * 64 + __builtin_ctzll(both));
+      used[w] |= p.used[w];
     }
+    duplicates.insert(duplicates.end(), p.duplicates.begin(),
+                      p.duplicates.end());
+    invalid.insert(invalid.end(), p.invalid.begin(), p.invalid.end());
   }
-  mounted = true;
-  return 1;  // Return success
+
+  sort(duplicates.begin(), duplicates.end());
+  duplicates.erase(unique(duplicates.begin(), duplicates.end()),
+                   duplicates.end());
+  for (int block : duplicates)
+    cout << "Warning: block " << block << " is used more than once.\n";
+  for (auto &p : invalid)
+    cout << "Warning: inode " << p.first << " points to invalid block "
+         << p.second << ".\n";
+
+  // Build the bitmaps of free blocks and inodes
+  free_blocks = Block_Bitmap(
+      superblock.nblocks);  // Assume all blocks are ionitially free
+  free_inodes = Block_Bitmap(superblock.ninodes);
+
+  // Mark superblock, inode blocks and bitmap blocks as used
+  for (int i = 0; i < first_data; ++i) free_blocks.set_used(i);
+
+  for (int w = 0; w < nwords; ++w)
+    for (uint64_t bits = used[w]; bits; bits &= bits - 1)
+      free_blocks.set_used(w * 64 + __builtin_ctzll(bits));
+
+  for (auto &loaded : inode_block_loaded) loaded = true;
+  for (int i = 1; i <= superblock.ninodes; ++i)
+    if (inode_table[i - 1].isvalid) free_inodes.set_used(i - 1);
 }
 
 int INE5412_FS::fs_umount() {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_UMOUNT);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::UMOUNT);
+  unique_lock<shared_mutex> lock(op_lock);
   if (!mounted) {
     cout << "Error: filesystem is already umounted.\n";
     return 0;
   }
 
+  // Make sure everything written while mounted reaches the disk
+  writebuf.flush();
+  if (journal.running()) commit_metadata();
+  flush_inodes();
+  flush_bitmaps();
+  journal.stop();
+  if (superblock.version >= 1) {
+    superblock.clean = FS_CLEAN;
+    write_superblock();
+  }
+  readahead.clear();
+  cache.flush();
+  disk->sync();
+
   mounted = false;
-  free_blocks.clear();
+  free_blocks = Block_Bitmap();
+  free_inodes = Block_Bitmap();
+  inode_table.clear();
+  inline_tails.clear();
+  inode_block_loaded = vector<atomic<bool>>();
+  traced.set_result(1);
   return 1;
 }
 
+int INE5412_FS::fs_sync() {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_SYNC);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::SYNC);
+  unique_lock<shared_mutex> lock(op_lock);
+  if (!is_usable()) {
+    cout << "Error: Disk not mounted\n";
+    return 0;
+  }
+
+  // Same as fs_umount, but the disk stays mounted and is not marked clean.
+  // With the journal running, committing is enough.
+  writebuf.flush();
+  if (journal.running()) {
+    commit_metadata();
+    traced.set_result(1);
+    return 1;
+  }
+  flush_inodes();
+  flush_bitmaps();
+  cache.flush();
+  disk->sync();
+  traced.set_result(1);
+  return 1;
+}
+
+void INE5412_FS::end_operation() {
+  if (journal.running() && journal.add_operation())
+    commit_due = maintenance_due = true;
+}
+
+void INE5412_FS::finish_operation() {
+  if (!maintenance_due) return;
+  unique_lock<shared_mutex> lock(op_lock);
+  if (mounted) maintain();
+}
+
+void INE5412_FS::maintain() {
+  // The work is cleared before it is done: anything found due meanwhile
+  // is left for the next operation
+  maintenance_due = false;
+  if (commit_due.exchange(false) && journal.running()) commit_metadata();
+  if (dirty_inode_blocks.size() >= INODE_FLUSH_BLOCKS) flush_inodes();
+  if (writebuf.full()) writebuf.flush();
+}
+
+void INE5412_FS::commit_metadata() {
+  // Data goes to the disk before the metadata that refers to it is
+  // committed, so that after a crash no inode covers blocks never written
+  writebuf.flush();
+  disk->drain();
+
+  // The blocks freed since the last commit can be reused once the freeing
+  // is committed with them
+  for (int blocknum : freed_blocks) free_blocks.set_free(blocknum);
+  freed_blocks.clear();
+
+  flush_inodes();
+  flush_bitmaps();
+  journal.commit();
+}
+
 bool INE5412_FS::is_usable() { return mounted; }
 bool INE5412_FS::is_usable(int inumber) {
   return mounted && inumber_is_valid(inumber);
 }
 
 int INE5412_FS::fs_create() {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_CREATE);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::CREATE);
+  op_guard guard(this);
   if (!is_usable()) {
     cout << "Error: Disk not mounted\n";
     return 0;  // Return failure
@@ -182,52 +676,124 @@ int INE5412_FS::fs_create() {
     return 0;  // Return failure
   }
 
-  int inumber = result.value().first;
-  fs_block inodeBlock = result.value().second;
-  fs_inode *inode = &inodeBlock.inode[find_inode_offset(inumber)];
+  int inumber = result.value();
+  unique_lock<shared_mutex> inodeLock(inode_lock(inumber));
+  init_inode(inumber);
+  end_operation();
 
-  inode->isvalid = 1;  // Mark the inode as valid
-  inode->size = 0;     // New inode with zero length
+  // Step 3: Return the inode number (positive)
+  traced.set_result(inumber);
+  return inumber;
+}
 
-  for (int i = 0; i < POINTERS_PER_INODE; ++i) inode->direct[i] = 0;
-  inode->indirect = 0;
+int INE5412_FS::fs_create_many(int count, int *inumbers) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_CREATE_MANY);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::CREATE_MANY, 0, 0, count);
+  unique_lock<shared_mutex> lock(op_lock);
+  if (!is_usable()) {
+    cout << "Error: Disk not mounted\n";
+    return 0;  // Return failure
+  }
 
-  // Write the updated inode block back to disk
-  disk->write(find_inode_block(inumber), inodeBlock.data);
+  // Take free inodes in order, so that each inode block is filled before
+  // the next one is started; each filled block counts as one operation.
+  int created = 0;
+  int lastBlock = 0;
+  optional<int> result;
+  while (created < count &&
+         (result = find_free_inode(created ? inumbers[created - 1] : 0))) {
+    int inumber = result.value();
+    if (lastBlock && find_inode_block(inumber) != lastBlock) {
+      end_operation();
+      maintain();
+    }
+    lastBlock = find_inode_block(inumber);
 
-  // Step 3: Return the inode number (positive)
-  return inumber;
+    init_inode(inumber);
+    inumbers[created++] = inumber;
+  }
+  if (created) {
+    end_operation();
+    maintain();
+  }
+
+  if (created < count) cout << "Error: No free inodes available.\n";
+  traced.set_inodes(inumbers, created);
+  traced.set_result(created);
+  return created;
 }
 
-optional<pair<int, INE5412_FS::fs_block>> INE5412_FS::find_free_inode() {
-  // Iterate through inodes to find the first free one
-  for (int i = 1; i <= superblock.ninodeblocks; ++i) {
-    fs_block inodeBlock = read_block(i);
+void INE5412_FS::init_inode(int inumber) {
+  fs_inode *inode = get_inode(inumber);
 
-    for (int j = 0; j < INODES_PER_BLOCK; ++j) {
-      fs_inode *inode = &inodeBlock.inode[j];
+  // Mark the inode as valid, mapped the best way the disk supports
+  inode->isvalid = INODE_VALID;
+  if (create_extents && superblock.version >= 2)
+    inode->isvalid |= INODE_EXTENTS;
+  else if (superblock.version >= 3)
+    inode->isvalid |= INODE_MULTILEVEL;
+  // and holding its data itself until it outgrows the inode
+  if (superblock.version >= 6) inode->isvalid |= INODE_INLINE;
+  inode->size = 0;  // New inode with zero length
 
-      if (!inode->isvalid) {
-        // Mark the inode as used
-        inode->isvalid = 1;
-        return {{(i - 1) * INODES_PER_BLOCK + j + 1,
-                 inodeBlock}};  // Return the inode number
-      }
+  for (int i = 0; i < POINTERS_PER_INODE; ++i) inode->direct[i] = 0;
+  inode->indirect = 0;
+  if (has_large_inodes()) memset(inline_tail(inode), 0, INLINE_TAIL_SIZE);
+
+  mark_inode_dirty(inumber);
+}
+
+optional<int> INE5412_FS::find_free_inode(int from) {
+  // Take the lowest free inode number. Its inode block is loaded while the
+  // inode is still free, so that a block with no inodes in use is not read;
+  // if another thread took the inode meanwhile, look again.
+  while (true) {
+    int bit;
+    {
+      lock_guard<mutex> lock(alloc_lock);
+      bit = free_inodes.next_free(from);
+    }
+    if (bit < 0) return {};  // No free inode found
+
+    get_inode(bit + 1);
+    lock_guard<mutex> lock(alloc_lock);
+    if (free_inodes.is_free(bit)) {
+      free_inodes.set_used(bit);
+      return bit + 1;
     }
   }
+}
+
+void INE5412_FS::mark_inode_dirty(int inumber) {
+  lock_guard<mutex> lock(meta_lock);
+  dirty_inode_blocks.insert(find_inode_block(inumber));
 
-  return {};  // No free inode found
+  // Do not let changes pile up without bound between unmounts
+  if (dirty_inode_blocks.size() >= INODE_FLUSH_BLOCKS) maintenance_due = true;
+}
+
+void INE5412_FS::flush_inodes() {
+  // Rebuild each changed inode block from the table; the whole block is
+  // overwritten, so it does not have to be read first.
+  for (int blocknum : dirty_inode_blocks) {
+    fs_block block;
+    store_inode_block(blocknum, &block);
+    cache.write(blocknum, block.data);
+  }
+  dirty_inode_blocks.clear();
 }
 
 int INE5412_FS::fs_delete(int inumber) {
-  if (!is_usable()) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_DELETE);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::DELETE, inumber);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
     cout << "Error: Disk not mounted or invalid inumber\n";
     return 0;  // Return failure
   }
+  unique_lock<shared_mutex> inodeLock(inode_lock(inumber));
 
-  // Read the inode block containing the target inode
-  fs_block inodeBlock = read_block(find_inode_block(inumber));
-  fs_inode *inode = &inodeBlock.inode[find_inode_offset(inumber)];
+  fs_inode *inode = get_inode(inumber);
 
   // Check if the inode is valid
   if (!inode->isvalid) {
@@ -235,42 +801,66 @@ int INE5412_FS::fs_delete(int inumber) {
     return 0;
   }
 
-  // Free data blocks and indirect blocks associated with the inode
-  for (int i = 0; i < POINTERS_PER_INODE; i++) {
-    if (inode->direct[i]) {
-      // Free the direct block
-      free_blocks[inode->direct[i]] = true;
+  if (is_inline(inode)) {
+    // The data is in the inode, there are no blocks to free
+  } else if (uses_extents(inode)) {
+    // Free every block of every extent, then the extent block
+    fs_block buffer;
+    const fs_extent *more = nullptr;
+    if (inode->indirect) {
+      more = read_block(inode->indirect, &buffer)->extents;
+      free_block(inode->indirect);
     }
-  }
-  if (inode->indirect) {
-    // Free the indirect block
-    free_blocks[inode->indirect] = true;
-
-    // Free data blocks pointed by the indirect block
-    fs_block indirectBlock = read_block(inode->indirect);
-    for (int i = 0; i < POINTERS_PER_BLOCK; ++i) {
-      if (indirectBlock.pointers[i]) {
-        free_blocks[indirectBlock.pointers[i]] = true;
+    for (int e = 0; e < inode->nextents; ++e) {
+      const fs_extent &x = get_extent(*inode, more, e);
+      if (!x.start) continue;  // a hole
+      for (int k = 0; k < x.length; ++k) free_block(x.start + k);
+    }
+  } else {
+    // Free data blocks and indirect blocks associated with the inode
+    int ndirect = is_multilevel(inode) ? POINTERS_PER_INODE - 2
+                                       : POINTERS_PER_INODE;
+    for (int i = 0; i < ndirect; i++) {
+      if (inode->direct[i]) {
+        // Free the direct block
+        free_block(inode->direct[i]);
       }
     }
+
+    // Free the indirect blocks and the data blocks under them
+    free_map_tree(inode->indirect, 1);
+    if (is_multilevel(inode)) {
+      free_map_tree(inode->double_indirect, 2);
+      free_map_tree(inode->triple_indirect, 3);
+    }
   }
+
   // Mark the inode as invalid
+  writebuf.forget(inumber);
   inode->isvalid = 0;
+  {
+    lock_guard<mutex> lock(alloc_lock);
+    free_inodes.set_free(inumber - 1);
+  }
+  readahead.forget(inumber);
 
-  // Write the update inode block back to the disk
-  disk->write(find_inode_block(inumber), inodeBlock.data);
+  mark_inode_dirty(inumber);
+  end_operation();
+  traced.set_result(1);
   return 1;
 }
 
 int INE5412_FS::fs_getsize(int inumber) {
-  if (!is_usable()) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_GETSIZE);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::GETSIZE, inumber);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
     cout << "Error: Disk not mounted or invalid inumber\n";
     return 0;  // Return failure
   }
+  shared_lock<shared_mutex> inodeLock(inode_lock(inumber));
 
-  // Read the inode block containing the target inode
-  fs_block inodeBlock = read_block(find_inode_block(inumber));
-  fs_inode *inode = &inodeBlock.inode[find_inode_offset(inumber)];
+  const fs_inode *inode = get_inode(inumber);
 
   // Check if the inode is valid
   if (!inode->isvalid) {
@@ -279,18 +869,236 @@ int INE5412_FS::fs_getsize(int inumber) {
   }
 
   // Return the size of the inode
+  traced.set_result(inode->size);
   return inode->size;
 }
 
+int INE5412_FS::fs_stat(int inumber, INE5412_FS::fs_stat_info *info) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_STAT);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::STAT, inumber);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
+    cout << "Error: Disk not mounted or invalid inumber\n";
+    return 0;  // Return failure
+  }
+  shared_lock<shared_mutex> inodeLock(inode_lock(inumber));
+
+  fs_inode *inode = get_inode(inumber);
+  if (!inode->isvalid) {
+    cout << "Error: Inode is not valid.\n";
+    return 0;
+  }
+
+  info->size = inode->size;
+  info->flags = inode->isvalid;
+  map_cursor cursor;
+  info->blocks = count_blocks(inode, &cursor);
+  traced.set_result(1);
+  return 1;
+}
+
+int INE5412_FS::fs_fallocate(int inumber, int length) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_FALLOCATE);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::FALLOCATE, inumber, 0,
+                              length);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
+    cout << "Error: Disk not mounted or invalid inumber\n";
+    return 0;  // Return failure
+  }
+  unique_lock<shared_mutex> inodeLock(inode_lock(inumber));
+
+  fs_inode *inode = get_inode(inumber);
+
+  // Check if the inode is valid
+  if (!inode->isvalid) {
+    cout << "Error: Inode is not valid.\n";
+    return 0;
+  }
+
+  if (length < 0 || length > max_file_size(inode)) {
+    cout << "Error: Invalid length.\n";
+    return 0;
+  }
+
+  if (is_compressed(inode)) {
+    cout << "Error: Cannot reserve blocks for a compressed file.\n";
+    return 0;
+  }
+
+  // An inline inode has room for inline_capacity() bytes already; reserving
+  // more moves its data to a block
+  map_cursor cursor;
+  if (is_inline(inode) && length > inline_capacity() &&
+      !promote_inline(inumber, inode, &cursor))
+    return 0;
+
+  // Map every missing block up to length, holes included. New blocks of an
+  // extent inode are asked for as one run of all the blocks still missing,
+  // as in fs_write_stream. A block filling a hole inside the file must keep
+  // reading as zeros, so it is written with zeros.
+  int nblocks =
+      (int)(((long)length + Disk::DISK_BLOCK_SIZE - 1) / Disk::DISK_BLOCK_SIZE);
+  if (is_inline(inode)) nblocks = 0;
+  bool full = false;
+  fs_block zeros = {};
+  atomic<int> inFlight(0);
+  for (int i = 0; i < nblocks && !full; ++i) {
+    if (data_block_number(inode, i, &cursor)) continue;
+    int blockNum = allocate_block(inode, i, nblocks - i, &cursor);
+    full = !blockNum;
+    if (blockNum && !past_end(inode, i)) {
+      cache.discard(blockNum);
+      readahead.invalidate(blockNum);
+      journal.revoke(blockNum);
+      inFlight++;
+      disk->submit_write(blockNum, zeros.data, [&inFlight]() { inFlight--; });
+    }
+  }
+  while (inFlight) disk->poll(true);
+
+  mark_inode_dirty(inumber);
+  flush_map(&cursor);
+  end_operation();
+
+  if (full) {
+    cout << "Error: Disk Full!!\n";
+    return 0;
+  }
+  traced.set_result(1);
+  return 1;
+}
+
+int INE5412_FS::fs_truncate(int inumber, int length) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_TRUNCATE);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::TRUNCATE, inumber, 0,
+                              length);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
+    cout << "Error: Disk not mounted or invalid inumber\n";
+    return 0;  // Return failure
+  }
+  unique_lock<shared_mutex> inodeLock(inode_lock(inumber));
+
+  fs_inode *inode = get_inode(inumber);
+
+  // Check if the inode is valid
+  if (!inode->isvalid) {
+    cout << "Error: Inode is not valid.\n";
+    return 0;
+  }
+
+  if (length < 0 || length > max_file_size(inode) ||
+      (length > inode->size && !supports_holes())) {
+    cout << "Error: Invalid length.\n";
+    return 0;
+  }
+
+  map_cursor cursor;
+  if (is_inline(inode) && length > inline_capacity() &&
+      !promote_inline(inumber, inode, &cursor))
+    return 0;
+
+  if (is_inline(inode)) {
+    // The bytes of the inode past the end of the file stay zero
+    if (length < inode->size)
+      write_inline(inode, nullptr, inode->size - length, length);
+    inode->size = length;
+  } else if (length > inode->size) {
+    // Growing leaves a hole up to the new end
+    zero_range(inumber, inode, inode->size, length, &cursor);
+    flush_map(&cursor);
+    inode->size = length;
+  } else {
+    // The blocks past the new end are freed, so no buffered write may reach
+    // them later
+    int nblocks = (int)(((long)length + Disk::DISK_BLOCK_SIZE - 1) /
+                        Disk::DISK_BLOCK_SIZE);
+    if (is_compressed(inode)) {
+      // Whole clusters are kept, the last one with its bytes past the new
+      // end zeroed
+      int cluster = length / CLUSTER_SIZE, kept = length % CLUSTER_SIZE;
+      nblocks = (cluster + (kept > 0)) * CLUSTER_BLOCKS;
+      if (kept && length < inode->size) {
+        vector<char> plain(CLUSTER_SIZE);
+        read_cluster(inode, cluster, plain.data(), &cursor);
+        memset(plain.data() + kept, 0, CLUSTER_SIZE - kept);
+        bool written = write_cluster(inode, cluster, plain.data(), &cursor);
+        flush_map(&cursor);
+        if (!written) {
+          cout << "Error: Disk Full!!\n";
+          return 0;
+        }
+      }
+    }
+    writebuf.forget(inumber, nblocks);
+    truncate_blocks(inode, nblocks);
+    inode->size = length;
+    readahead.forget(inumber);
+  }
+
+  mark_inode_dirty(inumber);
+  end_operation();
+  traced.set_result(1);
+  return 1;
+}
+
+int INE5412_FS::fs_compress(int inumber) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_COMPRESS);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::COMPRESS, inumber);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
+    cout << "Error: Disk not mounted or invalid inumber\n";
+    return 0;  // Return failure
+  }
+  unique_lock<shared_mutex> inodeLock(inode_lock(inumber));
+
+  fs_inode *inode = get_inode(inumber);
+
+  // Check if the inode is valid
+  if (!inode->isvalid) {
+    cout << "Error: Inode is not valid.\n";
+    return 0;
+  }
+
+  if (superblock.version < 7) {
+    cout << "Error: Disk does not support compression.\n";
+    return 0;
+  }
+
+  if (inode->size) {
+    cout << "Error: Only empty files can be compressed.\n";
+    return 0;
+  }
+
+  // Blocks reserved past the end are given back. A compressed file is
+  // mapped by pointers, which hold the holes in its clusters for free.
+  if (!is_inline(inode)) {
+    truncate_blocks(inode, 0);
+    for (int i = 0; i < POINTERS_PER_INODE; ++i) inode->direct[i] = 0;
+    inode->indirect = 0;
+  }
+  inode->isvalid = (inode->isvalid & (INODE_VALID | INODE_INLINE)) |
+                   INODE_MULTILEVEL | INODE_COMPRESSED;
+
+  mark_inode_dirty(inumber);
+  end_operation();
+  traced.set_result(1);
+  return 1;
+}
+
 int INE5412_FS::fs_read(int inumber, char *data, int length, int offset) {
-  if (!is_usable()) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_READ);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::READ, inumber, offset,
+                              length);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
     cout << "Error: Disk not mounted or invalid inumber\n";
     return 0;  // Return failure
   }
+  shared_lock<shared_mutex> inodeLock(inode_lock(inumber));
 
-  // Read the inode block containing the target inode
-  fs_block inodeBlock = read_block(find_inode_block(inumber));
-  fs_inode *inode = &inodeBlock.inode[find_inode_offset(inumber)];
+  fs_inode *inode = get_inode(inumber);
 
   // Check if the inode is valid
   if (!inode->isvalid) {
@@ -298,6 +1106,53 @@ int INE5412_FS::fs_read(int inumber, char *data, int length, int offset) {
     return 0;
   }
 
+  map_cursor cursor;
+  int bytesRead = read_range(inumber, inode, data, length, offset, &cursor);
+
+  timing.set_bytes(bytesRead);
+  traced.set_result(bytesRead);
+  return bytesRead;
+}
+
+int INE5412_FS::fs_readv(int inumber, const struct iovec *iov, int iovcnt,
+                         int offset) {
+  int length = iov_length(iov, iovcnt);
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_READV);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::READ, inumber, offset,
+                              length);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
+    cout << "Error: Disk not mounted or invalid inumber\n";
+    return 0;  // Return failure
+  }
+  shared_lock<shared_mutex> inodeLock(inode_lock(inumber));
+
+  fs_inode *inode = get_inode(inumber);
+
+  // Check if the inode is valid
+  if (!inode->isvalid) {
+    cout << "Error: Inode is not valid.\n";
+    return 0;
+  }
+
+  // The buffers are filled in turn, sharing the mapping blocks read
+  int bytesRead = 0;
+  map_cursor cursor;
+  for (int i = 0; i < iovcnt && bytesRead < length; ++i) {
+    int wanted = (int)min((long)iov[i].iov_len, (long)(length - bytesRead));
+    int n = read_range(inumber, inode, (char *)iov[i].iov_base, wanted,
+                       offset + bytesRead, &cursor);
+    bytesRead += n;
+    if (n < wanted) break;
+  }
+
+  timing.set_bytes(bytesRead);
+  traced.set_result(bytesRead);
+  return bytesRead;
+}
+
+int INE5412_FS::read_range(int inumber, fs_inode *inode, char *data,
+                           int length, int offset, map_cursor *cursor) {
   // Check if the offset is within the valid range
   if (offset < 0 || offset >= inode->size) {
     return 0;
@@ -305,38 +1160,116 @@ int INE5412_FS::fs_read(int inumber, char *data, int length, int offset) {
 
   // Calculate the effective lenght to read (considering the end of the inode)
   int effectiveLength = min(length, inode->size - offset);
+  if (effectiveLength <= 0) return 0;
 
-  // Read data from the inode starting at the offset
+  // Data in the inode needs no disk access at all
+  if (is_inline(inode)) {
+    read_inline(inode, data, effectiveLength, offset);
+    return effectiveLength;
+  }
+  if (is_compressed(inode))
+    return read_compressed(inode, data, effectiveLength, offset, cursor);
+
+  // Find which blocks should be read ahead for the next call. A mapped disk
+  // is left to the kernel's own read-ahead.
+  int firstIndex = offset / Disk::DISK_BLOCK_SIZE;
+  int lastIndex = (offset + effectiveLength - 1) / Disk::DISK_BLOCK_SIZE;
+  int aheadFrom = 0, aheadTo = 0;
+  if (!disk->is_mapped()) {
+    int fileBlocks =
+        (inode->size + Disk::DISK_BLOCK_SIZE - 1) / Disk::DISK_BLOCK_SIZE;
+    readahead.access(inumber, firstIndex, lastIndex, fileBlocks, &aheadFrom,
+                     &aheadTo);
+  }
+
+  // Read data from the inode starting at the offset. Every block is submitted
+  // to the disk without waiting, so several reads are in flight at once.
+  // Whole blocks land straight in data, and whole blocks that are also
+  // contiguous on disk (as in an extent) are read with a single request;
+  // only the first and last block may be partly read, and those go through
+  // edge[] and are copied on completion.
   int bytesRead = 0;
-  int *indirect_pointers = nullptr;
+  fs_block edge[2];
+  atomic<int> inFlight(0);
+
+  int runStart = 0, runLength = 0;
+  char *runData = nullptr;
+  auto submit_run = [&]() {
+    if (!runLength) return;
+    inFlight++;
+    disk->submit_read_blocks(runStart, runLength, runData,
+                             [&inFlight]() { inFlight--; });
+    runLength = 0;
+  };
+
   while (bytesRead < effectiveLength) {
     // Calculate the block index and position within the block
     int blockOffset = (offset + bytesRead) % Disk::DISK_BLOCK_SIZE;
-    fs_block dataBlock =
-        read_block(inode, offset + bytesRead, &indirect_pointers);
+    int blockIndex = (offset + bytesRead) / Disk::DISK_BLOCK_SIZE;
+    int blockNum = data_block_number(inode, blockIndex, cursor);
 
-    // Copy data from the block to the provided data pointer
     int bytesToCopy =
         min(effectiveLength - bytesRead, Disk::DISK_BLOCK_SIZE - blockOffset);
-    for (int i = 0; i < bytesToCopy; i++) {
-      data[bytesRead++] = dataBlock.data[blockOffset++];
+    char *dest = data + bytesRead;
+
+    if (const char *buffered = writebuf.lookup(inumber, blockIndex)) {
+      submit_run();
+      memcpy(dest, buffered + blockOffset, bytesToCopy);
+    } else if (!blockNum) {
+      // A hole reads as zeros, without touching the disk
+      submit_run();
+      memset(dest, 0, bytesToCopy);
+    } else if (const char *mapped = disk->map(blockNum)) {
+      memcpy(dest, mapped + blockOffset, bytesToCopy);
+    } else if (readahead.copy(blockNum, blockOffset, bytesToCopy, dest)) {
+      submit_run();
+    } else if (bytesToCopy == Disk::DISK_BLOCK_SIZE) {
+      if (runLength && blockNum == runStart + runLength) {
+        runLength++;
+      } else {
+        submit_run();
+        runStart = blockNum;
+        runLength = 1;
+        runData = dest;
+      }
+    } else {
+      submit_run();
+      fs_block *partial = &edge[bytesRead == 0 ? 0 : 1];
+      inFlight++;
+      disk->submit_read(blockNum, partial->data, [=, &inFlight]() {
+        memcpy(dest, partial->data + blockOffset, bytesToCopy);
+        inFlight--;
+      });
     }
+    bytesRead += bytesToCopy;
   }
+  submit_run();
+
+  // Queue the read-ahead behind this call's own reads and return without
+  // waiting for it. Blocks with a buffered write are newer in memory than on
+  // the disk and are left alone.
+  for (int i = aheadFrom; i < aheadTo; ++i)
+    if (!writebuf.lookup(inumber, i))
+      readahead.prefetch(data_block_number(inode, i, cursor));
+
+  while (inFlight) disk->poll(true);
 
-  if (indirect_pointers) delete[] indirect_pointers;
   return bytesRead;
 }
 
 int INE5412_FS::fs_write(int inumber, const char *data, int length,
                          int offset) {
-  if (!is_usable()) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_WRITE);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::WRITE, inumber, offset,
+                              length);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
     cout << "Error: Disk not mounted or invalid inumber\n";
     return 0;  // Return failure
   }
+  unique_lock<shared_mutex> inodeLock(inode_lock(inumber));
 
-  // Read the inode block containing the target inode
-  fs_block inodeBlock = read_block(find_inode_block(inumber));
-  fs_inode *inode = &inodeBlock.inode[find_inode_offset(inumber)];
+  fs_inode *inode = get_inode(inumber);
 
   // Check if the inode is valid
   if (!inode->isvalid) {
@@ -344,164 +1277,1115 @@ int INE5412_FS::fs_write(int inumber, const char *data, int length,
     return 0;
   }
 
-  // Check if the offset is within the valid range
-  if (offset < 0 || offset > inode->size) {
+  // Check if the offset is within the valid range. Past the end of the file
+  // it leaves a hole, on disks that allow them.
+  if (offset < 0 || offset > max_file_size(inode) ||
+      (offset > inode->size && !supports_holes())) {
     cout << "Error: Invalid offset.\n";
     return 0;
   }
 
-  // Calculate the effective lenght to read (considering the end of the inode)
-  int effectiveLength =
-      min(length,
-          Disk::DISK_BLOCK_SIZE * (POINTERS_PER_INODE + POINTERS_PER_BLOCK) -
-              offset);
+  // Mapping blocks are read and changed through the cursor and written back
+  // once at the end
+  map_cursor cursor;
+  if (offset > inode->size && length > 0)
+    zero_range(inumber, inode, inode->size, offset, &cursor);
+  int bytesWritten = write_range(inumber, inode, data, length, offset, &cursor);
 
-  // Write data from the inode starting at the offset
+  mark_inode_dirty(inumber);
+
+  // write back the mapping blocks that changed
+  flush_map(&cursor);
+  end_operation();
+
+  timing.set_bytes(bytesWritten);
+
+  // Return the total number of bytes written
+  traced.set_result(bytesWritten);
+  return bytesWritten;
+}
+
+int INE5412_FS::fs_writev(int inumber, const struct iovec *iov, int iovcnt,
+                          int offset) {
+  int length = iov_length(iov, iovcnt);
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_WRITEV);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::WRITE, inumber, offset,
+                              length);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
+    cout << "Error: Disk not mounted or invalid inumber\n";
+    return 0;  // Return failure
+  }
+  unique_lock<shared_mutex> inodeLock(inode_lock(inumber));
+
+  fs_inode *inode = get_inode(inumber);
+
+  // Check if the inode is valid
+  if (!inode->isvalid) {
+    cout << "Error: Inode is not valid.\n";
+    return 0;
+  }
+
+  // Check if the offset is within the valid range. Past the end of the file
+  // it leaves a hole, on disks that allow them.
+  if (offset < 0 || offset > max_file_size(inode) ||
+      (offset > inode->size && !supports_holes())) {
+    cout << "Error: Invalid offset.\n";
+    return 0;
+  }
+
+  // The buffers are written in turn, sharing the mapping blocks changed
   int bytesWritten = 0;
+  map_cursor cursor;
+  if (offset > inode->size && length > 0)
+    zero_range(inumber, inode, inode->size, offset, &cursor);
+  for (int i = 0; i < iovcnt && bytesWritten < length; ++i) {
+    int wanted = (int)min((long)iov[i].iov_len, (long)(length - bytesWritten));
+    int n = write_range(inumber, inode, (const char *)iov[i].iov_base, wanted,
+                        offset + bytesWritten, &cursor);
+    bytesWritten += n;
+    if (n < wanted) break;
+  }
 
-  bool willNeedIndirectBlock =
-      (offset + effectiveLength) / Disk::DISK_BLOCK_SIZE > POINTERS_PER_INODE;
+  mark_inode_dirty(inumber);
+  flush_map(&cursor);
+  end_operation();
 
-  fs_block *indirect_block;
+  timing.set_bytes(bytesWritten);
+  traced.set_result(bytesWritten);
+  return bytesWritten;
+}
 
-  if (!willNeedIndirectBlock) {
-    indirect_block = nullptr;
-  } else if (inode->indirect) {
-    indirect_block = new fs_block;
-    disk->read(inode->indirect, indirect_block->data);
-  } else {
-    if (!allocate_indirect_block(inode)) {
+int INE5412_FS::fs_write_stream(int inumber, int offset, int length,
+                                function<int(char *, int)> fill) {
+  Op_Stats::scope timing(disk->stats(), Op_Stats::FS_WRITE_STREAM);
+  Trace_Recorder::call traced(&tracer, Trace_Recorder::WRITE, inumber, offset,
+                              length);
+  op_guard guard(this);
+  if (!is_usable(inumber)) {
+    cout << "Error: Disk not mounted or invalid inumber\n";
+    return 0;  // Return failure
+  }
+  unique_lock<shared_mutex> inodeLock(inode_lock(inumber));
+
+  fs_inode *inode = get_inode(inumber);
+
+  // Check if the inode is valid
+  if (!inode->isvalid) {
+    cout << "Error: Inode is not valid.\n";
+    return 0;
+  }
+
+  // Check if the offset is within the valid range. Past the end of the file
+  // it leaves a hole, on disks that allow them.
+  if (offset < 0 || offset > max_file_size(inode) ||
+      (offset > inode->size && !supports_holes())) {
+    cout << "Error: Invalid offset.\n";
+    return 0;
+  }
+
+  int effectiveLength = (int)min((long)length, max_file_size(inode) - offset);
+  if (effectiveLength <= 0) return 0;
+
+  map_cursor cursor;
+  if (is_inline(inode) &&
+      (long)offset + effectiveLength <= inline_capacity()) {
+    // A stream that fits in the inode is taken in one piece and kept there
+    char buffer[INLINE_DATA_SIZE + INLINE_TAIL_SIZE];
+    int got = fill(buffer, effectiveLength);
+    int bytesWritten = write_range(inumber, inode, buffer,
+                                   max(0, min(got, effectiveLength)), offset,
+                                   &cursor);
+    mark_inode_dirty(inumber);
+    end_operation();
+
+    timing.set_bytes(bytesWritten);
+    traced.set_result(bytesWritten);
+    return bytesWritten;
+  }
+  if (is_compressed(inode)) {
+    // Clusters are compressed whole, so the data goes through write_range a
+    // chunk at a time
+    vector<char> chunk(STREAM_CHUNK_BLOCKS * Disk::DISK_BLOCK_SIZE);
+    int bytesWritten = 0;
+    while (bytesWritten < effectiveLength) {
+      int wanted = min(effectiveLength - bytesWritten, (int)chunk.size());
+      int got = min(fill(chunk.data(), wanted), wanted);
+      if (got <= 0) break;
+      int n = write_range(inumber, inode, chunk.data(), got,
+                          offset + bytesWritten, &cursor);
+      bytesWritten += n;
+      if (n < got || got < wanted) break;
+    }
+    mark_inode_dirty(inumber);
+    flush_map(&cursor);
+    end_operation();
+
+    timing.set_bytes(bytesWritten);
+    traced.set_result(bytesWritten);
+    return bytesWritten;
+  }
+  if (is_inline(inode) && !promote_inline(inumber, inode, &cursor)) return 0;
+  if (offset > inode->size)
+    zero_range(inumber, inode, inode->size, offset, &cursor);
+
+  // Map every block of the range before any data moves. New blocks of an
+  // extent inode are asked for as one run of all the blocks still missing,
+  // so the file stays in as few extents as the free space allows. If the
+  // disk fills up, only the blocks mapped are written.
+  int firstIndex = offset / Disk::DISK_BLOCK_SIZE;
+  int lastIndex = (offset + effectiveLength - 1) / Disk::DISK_BLOCK_SIZE;
+  vector<int> blocks;
+  vector<bool> fresh;
+  blocks.reserve(lastIndex - firstIndex + 1);
+  for (int i = firstIndex; i <= lastIndex; ++i) {
+    int blockNum = data_block_number(inode, i, &cursor);
+    fresh.push_back(!blockNum || past_end(inode, i));
+    if (!blockNum)
+      blockNum = allocate_block(inode, i, lastIndex - i + 1, &cursor);
+    if (!blockNum) {
       cout << "Error: Disk Full!!\n";
-      return bytesWritten;
+      effectiveLength = i * Disk::DISK_BLOCK_SIZE - offset;
+      break;
     }
-    indirect_block = new fs_block;
-    disk->read(inode->indirect, indirect_block->data);
+    blocks.push_back(blockNum);
   }
 
+  // Two chunk buffers take turns: fill produces the next chunk into one
+  // while the writes of the previous chunk, submitted straight from the
+  // other, are in flight. A chunk holds its bytes at the same offset within
+  // its blocks as in the file, so that whole blocks go to the disk as they
+  // are, contiguous ones in a single request; the partial first and last
+  // block go through the write buffer.
+  vector<fs_block> chunks[2] = {vector<fs_block>(STREAM_CHUNK_BLOCKS),
+                                vector<fs_block>(STREAM_CHUNK_BLOCKS)};
+  atomic<int> inFlight[2] = {{0}, {0}};
+  int bytesWritten = 0;
+
+  for (int c = 0; bytesWritten < effectiveLength; c = 1 - c) {
+    int position = offset + bytesWritten;
+    int chunkOffset = position % Disk::DISK_BLOCK_SIZE;
+    int wanted = min(effectiveLength - bytesWritten,
+                     STREAM_CHUNK_BLOCKS * Disk::DISK_BLOCK_SIZE - chunkOffset);
+    char *chunk = chunks[c][0].data;
+
+    while (inFlight[c]) disk->poll(true);
+    int got = fill(chunk + chunkOffset, wanted);
+    if (got <= 0) break;
+    int chunkLength = min(got, wanted);
+
+    int runStart = 0, runLength = 0;
+    const char *runData = nullptr;
+    auto submit_run = [&]() {
+      if (!runLength) return;
+      inFlight[c]++;
+      disk->submit_write_blocks(runStart, runLength, runData,
+                                [&inFlight, c]() { inFlight[c]--; });
+      runLength = 0;
+    };
+
+    for (int done = 0; done < chunkLength;) {
+      int blockOffset = (position + done) % Disk::DISK_BLOCK_SIZE;
+      int blockIndex = (position + done) / Disk::DISK_BLOCK_SIZE;
+      int blockNum = blocks[blockIndex - firstIndex];
+      int bytesToCopy =
+          min(chunkLength - done, Disk::DISK_BLOCK_SIZE - blockOffset);
+      const char *source = chunk + chunkOffset + done;
+
+      cache.discard(blockNum);
+      readahead.invalidate(blockNum);
+      journal.revoke(blockNum);
+
+      if (bytesToCopy < Disk::DISK_BLOCK_SIZE) {
+        submit_run();
+        char *page = writebuf.page(inumber, blockIndex, blockNum,
+                                   !fresh[blockIndex - firstIndex]);
+        memcpy(page + blockOffset, source, bytesToCopy);
+      } else {
+        writebuf.drop(inumber, blockIndex);
+        if (runLength && blockNum == runStart + runLength) {
+          runLength++;
+        } else {
+          submit_run();
+          runStart = blockNum;
+          runLength = 1;
+          runData = source;
+        }
+      }
+      done += bytesToCopy;
+    }
+    submit_run();
+
+    bytesWritten += chunkLength;
+    if (got < wanted) break;
+  }
+  for (auto &n : inFlight)
+    while (n) disk->poll(true);
+  if (writebuf.full()) maintenance_due = true;
+
+  // The inode and its mapping blocks are written once, for the whole stream
+  if (bytesWritten && offset + bytesWritten > inode->size)
+    inode->size = offset + bytesWritten;
+  mark_inode_dirty(inumber);
+  flush_map(&cursor);
+  end_operation();
+
+  timing.set_bytes(bytesWritten);
+  traced.set_result(bytesWritten);
+  return bytesWritten;
+}
+
+int INE5412_FS::write_range(int inumber, fs_inode *inode, const char *data,
+                            int length, int offset, map_cursor *cursor) {
+  // Calculate the effective lenght to read (considering the end of the inode)
+  int effectiveLength = (int)min((long)length, max_file_size(inode) - offset);
+  if (effectiveLength <= 0) return 0;
+
+  // Data that still fits in the inode is kept there
+  if (is_inline(inode)) {
+    if ((long)offset + effectiveLength <= inline_capacity()) {
+      write_inline(inode, data, effectiveLength, offset);
+      inode->size = max(inode->size, offset + effectiveLength);
+      return effectiveLength;
+    }
+    if (!promote_inline(inumber, inode, cursor)) return 0;
+  }
+  if (is_compressed(inode))
+    return write_compressed(inode, data, effectiveLength, offset, cursor);
+
+  // Write data from the inode starting at the offset
+  int bytesWritten = 0;
+
+  // Whole blocks are written straight from data, without a copy, and whole
+  // blocks that are also contiguous on disk with a single request; the
+  // requests are all in flight at once and finished before returning. Only
+  // the first and last block may be partly written, and those go through the
+  // write buffer.
+  atomic<int> inFlight(0);
+  int runStart = 0, runLength = 0;
+  const char *runData = nullptr;
+  auto submit_run = [&]() {
+    if (!runLength) return;
+    inFlight++;
+    disk->submit_write_blocks(runStart, runLength, runData,
+                              [&inFlight]() { inFlight--; });
+    runLength = 0;
+  };
+
   while (bytesWritten < effectiveLength) {
     // Calculate the block index and position within the block
     int blockOffset = (offset + bytesWritten) % Disk::DISK_BLOCK_SIZE;
     int blockIndex = (offset + bytesWritten) / Disk::DISK_BLOCK_SIZE;
 
+    int bytesToCopy = min(effectiveLength - bytesWritten,
+                          Disk::DISK_BLOCK_SIZE - blockOffset);
+
     // number of the block that will be written to.
     // we only allocate a new block if theres no block already allocated  here.
-    int allocated_block_index =
-        (blockIndex < POINTERS_PER_INODE)
-            ? inode->direct[blockIndex]
-            : indirect_block->pointers[blockIndex - POINTERS_PER_INODE];
+    int newBlock = data_block_number(inode, blockIndex, cursor);
+    bool fresh = !newBlock || past_end(inode, blockIndex);
+
+    // a whole block of zeros over a hole leaves the hole as it is
+    if (!newBlock && bytesToCopy == Disk::DISK_BLOCK_SIZE &&
+        supports_holes() && is_zero(data + bytesWritten, bytesToCopy)) {
+      submit_run();
+      bytesWritten += bytesToCopy;
+      continue;
+    }
 
-    int newBlock = (allocated_block_index == 0)
-                       ? allocate_data_block(inode, blockIndex, &indirect_block)
-                       : allocated_block_index;
+    if (!newBlock)
+      newBlock = allocate_block(
+          inode, blockIndex,
+          (offset + effectiveLength - 1) / Disk::DISK_BLOCK_SIZE -
+              blockIndex + 1,
+          cursor);
 
     if (!newBlock) {
       cout << "Error: Disk Full!!\n";
       break;
     }
 
-    int bytesToCopy = min(effectiveLength - bytesWritten,
-                          Disk::DISK_BLOCK_SIZE - blockOffset);
-    // create the block containing the data
-    fs_block dataBlock;
-    // Copy data from the provided data pointer to the block
-    for (int i = 0; i < bytesToCopy; ++i) {
-      dataBlock.data[blockOffset++] = data[bytesWritten++];
+    // the data blocks bypass the cache and the read-ahead buffer, so neither
+    // may keep an old copy of this one.
+    cache.discard(newBlock);
+    readahead.invalidate(newBlock);
+    journal.revoke(newBlock);
+
+    // part of a block: change the buffered copy of it, which keeps the rest
+    // of the block and gathers the following small writes to it.
+    if (bytesToCopy < Disk::DISK_BLOCK_SIZE) {
+      char *page = writebuf.page(inumber, blockIndex, newBlock, !fresh);
+      memcpy(page + blockOffset, data + bytesWritten, bytesToCopy);
+      bytesWritten += bytesToCopy;
+      continue;
     }
+    writebuf.drop(inumber, blockIndex);
+
+    if (runLength && newBlock == runStart + runLength) {
+      runLength++;
+    } else {
+      submit_run();
+      runStart = newBlock;
+      runLength = 1;
+      runData = data + bytesWritten;
+    }
+    bytesWritten += bytesToCopy;
+  }
+  submit_run();
+  while (inFlight) disk->poll(true);
+  if (writebuf.full()) maintenance_due = true;
+
+  // update inode size if necessary; a write that failed leaves it as it
+  // was, even past the end
+  if (bytesWritten && offset + bytesWritten > inode->size)
+    inode->size = offset + bytesWritten;
+
+  return bytesWritten;
+}
 
-    // write the allocated block to disk.
-    disk->write(newBlock, dataBlock.data);
+int INE5412_FS::iov_length(const struct iovec *iov, int iovcnt) {
+  long length = 0;
+  for (int i = 0; i < iovcnt && length < INT_MAX; ++i)
+    length += iov[i].iov_len;
+  return (int)min(length, (long)INT_MAX);
+}
+
+void INE5412_FS::free_block(int blocknum) {
+  lock_guard<mutex> lock(alloc_lock);
+  if (journal.running())
+    freed_blocks.push_back(blocknum);
+  else
+    free_blocks.set_free(blocknum);
+}
+
+int INE5412_FS::find_free_iblock() {
+  // The superblock and inode table are never free, so this is always a data
+  // block
+  lock_guard<mutex> lock(alloc_lock);
+  int block = free_blocks.allocate();
+
+  // No free block found
+  if (block < 0) return 0;
+  return block;
+}
+
+const INE5412_FS::fs_block *INE5412_FS::read_block(
+    INE5412_FS::fs_inode *inode, int offset, INE5412_FS::map_cursor *cursor,
+    INE5412_FS::fs_block *buffer) {
+  int blocknum =
+      data_block_number(inode, offset / Disk::DISK_BLOCK_SIZE, cursor);
+  if (!blocknum) {
+    // A hole, or the start of an inline file
+    memset(buffer->data, 0, Disk::DISK_BLOCK_SIZE);
+    if (is_inline(inode))
+      read_inline(inode, buffer->data, inline_capacity(), 0);
+    return buffer;
   }
+  return read_block(blocknum, buffer);
+}
 
-  // update inode size if necessary
-  if (offset + bytesWritten > inode->size) inode->size = offset + bytesWritten;
+int INE5412_FS::data_block_number(INE5412_FS::fs_inode *inode,
+                                  int block_index,
+                                  INE5412_FS::map_cursor *cursor) {
+  if (is_inline(inode)) return 0;
+  if (uses_extents(inode))
+    return extent_lookup(inode, load_extents(inode, cursor), block_index);
+  return map_block(inode, block_index, cursor, false);
+}
 
-  // Write the updated inode back to the disk
-  disk->write(find_inode_block(inumber), inodeBlock.data);
+long INE5412_FS::max_file_size(const INE5412_FS::fs_inode *inode) {
+  if (uses_extents(inode) || is_multilevel(inode)) return INT_MAX;
+  return (long)Disk::DISK_BLOCK_SIZE *
+         (POINTERS_PER_INODE + POINTERS_PER_BLOCK);
+}
 
-  // if an indirect block was used, write it to disk and delete the pointer
-  if (indirect_block) {
-    disk->write(inode->indirect, indirect_block->data);
-    delete indirect_block;
+INE5412_FS::fs_block *INE5412_FS::load_map_block(
+    INE5412_FS::map_cursor *cursor, int depth, int blocknum) {
+  if (cursor->blocknum[depth] != blocknum) {
+    if (cursor->dirty[depth])
+      cache.write(cursor->blocknum[depth], cursor->block[depth].data);
+    cache.read(blocknum, cursor->block[depth].data);
+    cursor->blocknum[depth] = blocknum;
+    cursor->dirty[depth] = false;
   }
+  return &cursor->block[depth];
+}
 
-  // Return the total number of bytes written
-  return bytesWritten;
+int INE5412_FS::new_map_block(INE5412_FS::map_cursor *cursor, int depth) {
+  int blocknum = find_free_iblock();
+  if (!blocknum) return 0;
+
+  if (cursor->dirty[depth])
+    cache.write(cursor->blocknum[depth], cursor->block[depth].data);
+  memset(cursor->block[depth].data, 0, Disk::DISK_BLOCK_SIZE);
+  cursor->blocknum[depth] = blocknum;
+  cursor->dirty[depth] = true;
+  return blocknum;
+}
+
+void INE5412_FS::flush_map(INE5412_FS::map_cursor *cursor) {
+  for (int depth = 0; depth < MAP_LEVELS; ++depth) {
+    if (!cursor->dirty[depth]) continue;
+    cache.write(cursor->blocknum[depth], cursor->block[depth].data);
+    cursor->dirty[depth] = false;
+  }
+}
+
+int INE5412_FS::map_block(INE5412_FS::fs_inode *inode, int block_index,
+                          INE5412_FS::map_cursor *cursor, bool allocate) {
+  int depth;
+  int *pointer = block_pointer(inode, block_index, cursor, allocate, &depth);
+  if (!pointer) return 0;
+
+  if (!*pointer && allocate && (*pointer = find_free_iblock()) && depth)
+    cursor->dirty[depth - 1] = true;
+  return *pointer;
+}
+
+int *INE5412_FS::block_pointer(INE5412_FS::fs_inode *inode, int block_index,
+                               INE5412_FS::map_cursor *cursor, bool allocate,
+                               int *depth) {
+  int ndirect =
+      is_multilevel(inode) ? POINTERS_PER_INODE - 2 : POINTERS_PER_INODE;
+
+  *depth = 0;
+  if (block_index < ndirect) return &inode->direct[block_index];
+
+  // Find which tree holds the block: the indirect block covers the next
+  // POINTERS_PER_BLOCK blocks, the double indirect block the next
+  // POINTERS_PER_BLOCK^2 and the triple indirect block the rest.
+  long index = block_index - ndirect;
+  long span = POINTERS_PER_BLOCK;
+  int *pointer = &inode->indirect;
+  *depth = 1;
+  while (index >= span) {
+    if (!is_multilevel(inode) || *depth == MAP_LEVELS) return nullptr;
+    index -= span;
+    span *= POINTERS_PER_BLOCK;
+    pointer =
+        ++*depth == 2 ? &inode->double_indirect : &inode->triple_indirect;
+  }
+
+  // Walk down the tree, creating missing mapping blocks if allowed. pointer
+  // always points into the inode or into a block held by the cursor, which
+  // marks that block dirty when it is changed.
+  for (int d = 0; d < *depth; ++d) {
+    span /= POINTERS_PER_BLOCK;
+
+    fs_block *block;
+    if (*pointer) {
+      block = load_map_block(cursor, d, *pointer);
+    } else {
+      if (!allocate || !(*pointer = new_map_block(cursor, d))) return nullptr;
+      if (d > 0) cursor->dirty[d - 1] = true;
+      block = &cursor->block[d];
+    }
+
+    pointer = &block->pointers[index / span];
+    index %= span;
+  }
+  return pointer;
+}
+
+void INE5412_FS::unmap_block(INE5412_FS::fs_inode *inode, int block_index,
+                             INE5412_FS::map_cursor *cursor) {
+  int depth;
+  int *pointer = block_pointer(inode, block_index, cursor, false, &depth);
+  if (!pointer || !*pointer) return;
+
+  free_block(*pointer);
+  *pointer = 0;
+  if (depth) cursor->dirty[depth - 1] = true;
+}
+
+void INE5412_FS::free_map_tree(int blocknum, int depth) {
+  if (!blocknum) return;
+
+  if (depth > 0) {
+    fs_block block;
+    cache.read(blocknum, block.data);
+    for (int k = 0; k < POINTERS_PER_BLOCK; ++k)
+      free_map_tree(block.pointers[k], depth - 1);
+  }
+  free_block(blocknum);
+}
+
+int INE5412_FS::count_blocks(INE5412_FS::fs_inode *inode,
+                             INE5412_FS::map_cursor *cursor) {
+  int nblocks = 0;
+  if (is_inline(inode)) return 0;
+  if (uses_extents(inode)) {
+    const fs_extent *more = load_extents(inode, cursor);
+    for (int e = 0; e < inode->nextents; ++e) {
+      const fs_extent &x = get_extent(*inode, more, e);
+      if (x.start) nblocks += x.length;
+    }
+    return nblocks;
+  }
+
+  int ndirect =
+      is_multilevel(inode) ? POINTERS_PER_INODE - 2 : POINTERS_PER_INODE;
+  for (int i = 0; i < ndirect; ++i)
+    if (inode->direct[i]) nblocks++;
+  nblocks += count_map_tree(inode->indirect, 1);
+  if (is_multilevel(inode))
+    nblocks += count_map_tree(inode->double_indirect, 2) +
+               count_map_tree(inode->triple_indirect, 3);
+  return nblocks;
+}
+
+int INE5412_FS::count_map_tree(int blocknum, int depth) {
+  if (!blocknum) return 0;
+  if (!depth) return 1;
+
+  fs_block block;
+  cache.read(blocknum, block.data);
+  int nblocks = 0;
+  for (int k = 0; k < POINTERS_PER_BLOCK; ++k)
+    nblocks += count_map_tree(block.pointers[k], depth - 1);
+  return nblocks;
+}
+
+void INE5412_FS::truncate_blocks(INE5412_FS::fs_inode *inode, int nblocks) {
+  if (uses_extents(inode)) {
+    // Keep the extents up to nblocks, cutting the one it falls in, and free
+    // the rest. The extent block goes once the inode holds them all.
+    map_cursor cursor;
+    fs_extent *more = load_extents(inode, &cursor);
+    int kept = 0, nextents = 0;
+    for (int e = 0; e < inode->nextents; ++e) {
+      fs_extent &x = get_extent(*inode, more, e);
+      int keep = max(0, min(x.length, nblocks - kept));
+      if (x.start)
+        for (int k = keep; k < x.length; ++k) free_block(x.start + k);
+      if (keep) {
+        x.length = keep;
+        nextents = e + 1;
+      }
+      kept += keep;
+    }
+    inode->nextents = nextents;
+
+    if (inode->indirect && nextents <= INLINE_EXTENTS) {
+      cursor.dirty[0] = false;
+      free_block(inode->indirect);
+      inode->indirect = 0;
+    } else if (more) {
+      cursor.dirty[0] = true;
+    }
+    flush_map(&cursor);
+    return;
+  }
+
+  int ndirect =
+      is_multilevel(inode) ? POINTERS_PER_INODE - 2 : POINTERS_PER_INODE;
+  for (int i = nblocks; i < ndirect; ++i) {
+    if (inode->direct[i]) {
+      free_block(inode->direct[i]);
+      inode->direct[i] = 0;
+    }
+  }
+
+  long first = ndirect;
+  truncate_map_tree(&inode->indirect, 1, first, nblocks);
+  if (is_multilevel(inode)) {
+    first += POINTERS_PER_BLOCK;
+    truncate_map_tree(&inode->double_indirect, 2, first, nblocks);
+    first += (long)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+    truncate_map_tree(&inode->triple_indirect, 3, first, nblocks);
+  }
 }
 
-int INE5412_FS::allocate_indirect_block(INE5412_FS::fs_inode *inode) {
-  int num_indirect_block;
-  if (!(num_indirect_block = find_free_iblock())) return 0;
+bool INE5412_FS::truncate_map_tree(int *pointer, int depth, long first,
+                                   int nblocks) {
+  if (!*pointer) return false;
 
-  free_blocks[num_indirect_block] = false;
+  if (first >= nblocks) {
+    free_map_tree(*pointer, depth);
+    *pointer = 0;
+    return true;
+  }
 
-  inode->indirect = num_indirect_block;
-  fs_block indirect;
+  long span = 1;
+  for (int d = 0; d < depth; ++d) span *= POINTERS_PER_BLOCK;
+  if (first + span <= nblocks) return false;
+
+  // The tree is cut in the middle: trim its children
+  fs_block block;
+  cache.read(*pointer, block.data);
+  bool changed = false;
+  span /= POINTERS_PER_BLOCK;
+  for (int k = 0; k < POINTERS_PER_BLOCK; ++k)
+    changed |= truncate_map_tree(&block.pointers[k], depth - 1,
+                                 first + k * span, nblocks);
+  if (changed) cache.write(*pointer, block.data);
+  return changed;
+}
 
-  for (int i = 0; i < POINTERS_PER_BLOCK; ++i) indirect.pointers[i] = 0;
+INE5412_FS::fs_extent *INE5412_FS::load_extents(
+    INE5412_FS::fs_inode *inode, INE5412_FS::map_cursor *cursor) {
+  if (inode->nextents <= INLINE_EXTENTS || !inode->indirect) return nullptr;
+  return load_map_block(cursor, 0, inode->indirect)->extents;
+}
 
-  disk->write(num_indirect_block, indirect.data);
-  return num_indirect_block;
+int INE5412_FS::extent_lookup(const INE5412_FS::fs_inode *inode,
+                              const INE5412_FS::fs_extent *more,
+                              int block_index) {
+  for (int e = 0; e < inode->nextents; ++e) {
+    const fs_extent &x = get_extent(*inode, more, e);
+    if (block_index < x.length) return x.start ? x.start + block_index : 0;
+    block_index -= x.length;
+  }
+  return 0;
 }
 
-int INE5412_FS::allocate_data_block(INE5412_FS::fs_inode *inode,
-                                    int block_index,
-                                    INE5412_FS::fs_block **indirect_block) {
-  // find free block that will have data written to it.
+int INE5412_FS::append_extent_block(INE5412_FS::fs_inode *inode, int wanted,
+                                    INE5412_FS::map_cursor *cursor) {
+  fs_extent *more = load_extents(inode, cursor);
+
+  // Grow the last extent if the block right after it is free, unless it is
+  // a hole
+  if (inode->nextents) {
+    fs_extent &last = get_extent(*inode, more, inode->nextents - 1);
+    int next = last.start + last.length;
+    unique_lock<mutex> lock(alloc_lock);
+    if (last.start && next < superblock.nblocks &&
+        free_blocks.is_free(next)) {
+      free_blocks.set_used(next);
+      lock.unlock();
+      last.length++;
+      if (more) cursor->dirty[0] = true;
+      return next;
+    }
+  }
+
+  if (inode->nextents == INLINE_EXTENTS + EXTENTS_PER_BLOCK) return 0;
+
+  // Start a new extent, preferably where the rest of the write fits
   int new_block;
-  if (!(new_block = find_free_iblock())) return 0;
+  {
+    lock_guard<mutex> lock(alloc_lock);
+    new_block = free_blocks.find_free_run(wanted);
+    if (new_block > 0)
+      free_blocks.set_used(new_block);
+    else
+      new_block = free_blocks.allocate();
+  }
+  if (new_block <= 0) return 0;
+
+  // The first extent that does not fit in the inode needs the extent block
+  if (inode->nextents == INLINE_EXTENTS) {
+    if (!(inode->indirect = new_map_block(cursor, 0))) {
+      lock_guard<mutex> lock(alloc_lock);
+      free_blocks.set_free(new_block);
+      return 0;
+    }
+    more = cursor->block[0].extents;
+  }
 
-  free_blocks[new_block] = false;
+  fs_extent &x = get_extent(*inode, more, inode->nextents);
+  x.start = new_block;
+  x.length = 1;
+  inode->nextents++;
+  if (more) cursor->dirty[0] = true;
+  return new_block;
+}
 
-  if (block_index < POINTERS_PER_INODE) {
-    inode->direct[block_index] = new_block;
-  } else {
-    // if inode has no indirect block, allocate one.
-    if (!inode->indirect) {
-      allocate_indirect_block(inode);
-      if (!inode->indirect) return 0;
+bool INE5412_FS::insert_extents(INE5412_FS::fs_inode *inode, int index,
+                                int count, INE5412_FS::map_cursor *cursor) {
+  if (inode->nextents + count > INLINE_EXTENTS + EXTENTS_PER_BLOCK)
+    return false;
+
+  fs_extent *more = load_extents(inode, cursor);
+  if (!more && inode->nextents + count > INLINE_EXTENTS) {
+    if (!(inode->indirect = new_map_block(cursor, 0))) return false;
+    more = cursor->block[0].extents;
+  }
+
+  for (int e = inode->nextents - 1; e >= index; --e)
+    get_extent(*inode, more, e + count) = get_extent(*inode, more, e);
+  inode->nextents += count;
+  if (more) cursor->dirty[0] = true;
+  return true;
+}
+
+void INE5412_FS::remove_extent(INE5412_FS::fs_inode *inode, int index,
+                               INE5412_FS::map_cursor *cursor) {
+  fs_extent *more = load_extents(inode, cursor);
+  for (int e = index + 1; e < inode->nextents; ++e)
+    get_extent(*inode, more, e - 1) = get_extent(*inode, more, e);
+  inode->nextents--;
+
+  if (inode->indirect && inode->nextents <= INLINE_EXTENTS) {
+    cursor->dirty[0] = false;
+    free_block(inode->indirect);
+    inode->indirect = 0;
+  } else if (more) {
+    cursor->dirty[0] = true;
+  }
+}
+
+bool INE5412_FS::append_extent_hole(INE5412_FS::fs_inode *inode, int length,
+                                    INE5412_FS::map_cursor *cursor) {
+  fs_extent *more = load_extents(inode, cursor);
+  if (inode->nextents) {
+    fs_extent &last = get_extent(*inode, more, inode->nextents - 1);
+    if (!last.start) {
+      last.length += length;
+      if (more) cursor->dirty[0] = true;
+      return true;
+    }
+  }
 
-      if (!(*indirect_block)) *indirect_block = new fs_block;
+  if (!insert_extents(inode, inode->nextents, 1, cursor)) return false;
+  more = load_extents(inode, cursor);
+  fs_extent &x = get_extent(*inode, more, inode->nextents - 1);
+  x.start = 0;
+  x.length = length;
+  return true;
+}
 
-      // set the provided pointer to the newly created block.
-      // this keeps us from having to read the indirect block from disk every
-      // time.
-      disk->read(inode->indirect, (*indirect_block)->data);
+int INE5412_FS::fill_extent_hole(INE5412_FS::fs_inode *inode, int index,
+                                 int offset, int wanted,
+                                 INE5412_FS::map_cursor *cursor) {
+  fs_extent *more = load_extents(inode, cursor);
+  int length = get_extent(*inode, more, index).length;
+
+  // Filling the start of a hole that follows a data extent grows that
+  // extent if the block right after it is free
+  if (offset == 0 && index > 0) {
+    fs_extent &previous = get_extent(*inode, more, index - 1);
+    int next = previous.start + previous.length;
+    unique_lock<mutex> lock(alloc_lock);
+    if (previous.start && next < superblock.nblocks &&
+        free_blocks.is_free(next)) {
+      free_blocks.set_used(next);
+      lock.unlock();
+      previous.length++;
+      get_extent(*inode, more, index).length--;
+      if (more) cursor->dirty[0] = true;
+      if (length == 1) remove_extent(inode, index, cursor);
+      return next;
     }
-    (*indirect_block)->pointers[block_index - POINTERS_PER_INODE] = new_block;
   }
 
+  int new_block;
+  {
+    lock_guard<mutex> lock(alloc_lock);
+    new_block = free_blocks.find_free_run(min(wanted, length - offset));
+    if (new_block > 0)
+      free_blocks.set_used(new_block);
+    else
+      new_block = free_blocks.allocate();
+  }
+  if (new_block <= 0) return 0;
+
+  // Split the hole around the new block: the part before it stays in the
+  // hole's extent and the part after it follows the block's own extent
+  int before = offset, after = length - offset - 1;
+  int added = (before > 0) + (after > 0);
+  if (!insert_extents(inode, index + 1, added, cursor)) {
+    lock_guard<mutex> lock(alloc_lock);
+    free_blocks.set_free(new_block);
+    return 0;
+  }
+  more = load_extents(inode, cursor);
+  if (before) get_extent(*inode, more, index++).length = before;
+  get_extent(*inode, more, index++) = {new_block, 1};
+  if (after) get_extent(*inode, more, index) = {0, after};
+  if (more) cursor->dirty[0] = true;
   return new_block;
 }
 
-int INE5412_FS::find_free_iblock() {
-  // Find a free block in the bitmap
-  for (int i = superblock.ninodeblocks + 1; i < superblock.nblocks; ++i) {
-    if (free_blocks[i]) {
-      free_blocks[i] = false;
-      return i;
+int INE5412_FS::allocate_block(INE5412_FS::fs_inode *inode, int block_index,
+                               int wanted, INE5412_FS::map_cursor *cursor) {
+  if (!uses_extents(inode))
+    return map_block(inode, block_index, cursor, true);
+
+  // Find the hole block_index falls in, if the extents reach that far
+  fs_extent *more = load_extents(inode, cursor);
+  int first = 0;
+  for (int e = 0; e < inode->nextents; ++e) {
+    const fs_extent &x = get_extent(*inode, more, e);
+    if (block_index < first + x.length) {
+      if (x.start) return x.start + block_index - first;
+      return fill_extent_hole(inode, e, block_index - first, wanted, cursor);
     }
+    first += x.length;
   }
 
-  // No free block found
-  return 0;
+  // Past the last extent, the blocks before block_index become a hole
+  if (block_index > first &&
+      !append_extent_hole(inode, block_index - first, cursor))
+    return 0;
+  return append_extent_block(inode, wanted, cursor);
+}
+
+void INE5412_FS::zero_range(int inumber, INE5412_FS::fs_inode *inode,
+                            int from, int to,
+                            INE5412_FS::map_cursor *cursor) {
+  // Holes already read as zeros. Only the mapped blocks of the range, such
+  // as the one holding the old end or blocks reserved by fs_fallocate, may
+  // hold stale bytes, and each run of them is overwritten. The clusters of
+  // a compressed file are zero past its end already.
+  //
+  // The size is kept, so that the blocks past the end stay fresh and a
+  // write that fails after the zeroing leaves the file as it was.
+  if (is_compressed(inode)) return;
+  int size = inode->size;
+  vector<char> zeros;
+  int runFrom = -1;
+  for (int position = from; position <= to;) {
+    int blockIndex = position / Disk::DISK_BLOCK_SIZE;
+    bool mapped =
+        position < to && data_block_number(inode, blockIndex, cursor);
+    if (mapped && runFrom < 0) runFrom = position;
+
+    while (!mapped && runFrom >= 0 && runFrom < position) {
+      int n = min(position - runFrom,
+                  STREAM_CHUNK_BLOCKS * Disk::DISK_BLOCK_SIZE);
+      if ((int)zeros.size() < n) zeros.resize(n);
+      write_range(inumber, inode, zeros.data(), n, runFrom, cursor);
+      runFrom += n;
+    }
+    if (!mapped) runFrom = -1;
+
+    if (position == to) break;
+    position = (int)min((long)to,
+                        ((long)blockIndex + 1) * Disk::DISK_BLOCK_SIZE);
+  }
+  inode->size = size;
+}
+
+bool INE5412_FS::is_zero(const char *data, int length) {
+  return !data[0] && !memcmp(data, data + 1, length - 1);
+}
+
+bool INE5412_FS::promote_inline(int inumber, INE5412_FS::fs_inode *inode,
+                                INE5412_FS::map_cursor *cursor) {
+  // The pointers start out zero, as in a new inode, and the data is written
+  // again as the first bytes of the file
+  char data[INLINE_DATA_SIZE + INLINE_TAIL_SIZE];
+  int size = inode->size;
+  read_inline(inode, data, inline_capacity(), 0);
+  write_inline(inode, nullptr, inline_capacity(), 0);
+  inode->isvalid &= ~INODE_INLINE;
+  inode->size = 0;
+
+  if (write_range(inumber, inode, data, size, 0, cursor) < size) {
+    // Nothing was mapped, the block being the first one
+    write_inline(inode, data, inline_capacity(), 0);
+    inode->isvalid |= INODE_INLINE;
+    inode->size = size;
+    return false;
+  }
+  return true;
+}
+
+void INE5412_FS::read_inline(const INE5412_FS::fs_inode *inode, char *data,
+                             int length, int offset) {
+  int head = max(0, min(length, INLINE_DATA_SIZE - offset));
+  if (head) memcpy(data, inode->inline_data + offset, head);
+  if (length > head)
+    memcpy(data + head, inline_tail(inode) + offset + head - INLINE_DATA_SIZE,
+           length - head);
+}
+
+void INE5412_FS::write_inline(INE5412_FS::fs_inode *inode, const char *data,
+                              int length, int offset) {
+  int head = max(0, min(length, INLINE_DATA_SIZE - offset));
+  if (head && data)
+    memcpy(inode->inline_data + offset, data, head);
+  else if (head)
+    memset(inode->inline_data + offset, 0, head);
+  if (length == head) return;
+
+  char *tail = inline_tail(inode) + offset + head - INLINE_DATA_SIZE;
+  if (data)
+    memcpy(tail, data + head, length - head);
+  else
+    memset(tail, 0, length - head);
+}
+
+void INE5412_FS::read_cluster(INE5412_FS::fs_inode *inode, int cluster,
+                              char *plain, INE5412_FS::map_cursor *cursor) {
+  // The blocks of a cluster are always its first ones
+  int first = cluster * CLUSTER_BLOCKS;
+  int blocks[CLUSTER_BLOCKS];
+  int nblocks = 0;
+  while (nblocks < CLUSTER_BLOCKS &&
+         (blocks[nblocks] = data_block_number(inode, first + nblocks, cursor)))
+    nblocks++;
+
+  if (!nblocks) {
+    memset(plain, 0, CLUSTER_SIZE);
+    return;
+  }
+
+  // A cluster stored as it is lands straight in plain
+  vector<char> packed;
+  char *target = plain;
+  if (nblocks < CLUSTER_BLOCKS) {
+    packed.resize(nblocks * Disk::DISK_BLOCK_SIZE);
+    target = packed.data();
+  }
+
+  atomic<int> inFlight(0);
+  for (int j = 0; j < nblocks;) {
+    int run = 1;
+    while (j + run < nblocks && blocks[j + run] == blocks[j] + run) run++;
+    inFlight++;
+    disk->submit_read_blocks(blocks[j], run,
+                             target + j * Disk::DISK_BLOCK_SIZE,
+                             [&inFlight]() { inFlight--; });
+    j += run;
+  }
+  while (inFlight) disk->poll(true);
+  if (nblocks == CLUSTER_BLOCKS) return;
+
+  int length;
+  memcpy(&length, target, sizeof(length));
+  int produced = -1;
+  if (length > 0 && length <= (int)(packed.size() - sizeof(length)))
+    produced = LZ_Codec::decompress(target + sizeof(length), length, plain,
+                                    CLUSTER_SIZE);
+  if (produced < 0) {
+    cout << "Error: Compressed cluster is damaged.\n";
+    produced = 0;
+  }
+  memset(plain + produced, 0, CLUSTER_SIZE - produced);
 }
 
-INE5412_FS::fs_block INE5412_FS::read_block(INE5412_FS::fs_inode *inode,
-                                            int offset,
-                                            int **indirect_block_ptr) {
-  int blockIndex = offset / Disk::DISK_BLOCK_SIZE;
-  int blockNum = (blockIndex < POINTERS_PER_INODE) ? inode->direct[blockIndex]
-                                                   : inode->indirect;
+bool INE5412_FS::write_cluster(INE5412_FS::fs_inode *inode, int cluster,
+                               const char *plain,
+                               INE5412_FS::map_cursor *cursor) {
+  // Compressed, the cluster is stored in as many blocks as its length and
+  // compressed bytes take, if that saves one. A cluster of zeros is a hole.
+  vector<char> packed((CLUSTER_BLOCKS - 1) * Disk::DISK_BLOCK_SIZE);
+  const char *source = plain;
+  int nblocks = CLUSTER_BLOCKS;
+  if (is_zero(plain, CLUSTER_SIZE)) {
+    nblocks = 0;
+  } else {
+    int length = LZ_Codec::compress(plain, CLUSTER_SIZE,
+                                    packed.data() + sizeof(length),
+                                    packed.size() - sizeof(length));
+    if (length) {
+      memcpy(packed.data(), &length, sizeof(length));
+      source = packed.data();
+      nblocks = (length + sizeof(length) + Disk::DISK_BLOCK_SIZE - 1) /
+                Disk::DISK_BLOCK_SIZE;
+    }
+  }
 
-  if (blockIndex >= POINTERS_PER_INODE) {
-    if (!(*indirect_block_ptr)) {
-      fs_block indirect = read_block(inode->indirect);
-      *indirect_block_ptr = new int[POINTERS_PER_BLOCK];
-      for (int i = 0; i < POINTERS_PER_BLOCK; ++i)
-        (*indirect_block_ptr)[i] = indirect.pointers[i];
+  // A raw cluster that stays raw is rewritten in its blocks, which tears no
+  // more than a plain file would. Any other cluster goes to new blocks: the
+  // committed mapping keeps describing the old ones, which are only reused
+  // once the new mapping is committed, so a crash before that leaves the
+  // cluster as it was instead of decoding the new bytes the old way.
+  int first = cluster * CLUSTER_BLOCKS;
+  int blocks[CLUSTER_BLOCKS];
+  int oldBlocks = 0;
+  while (oldBlocks < CLUSTER_BLOCKS &&
+         data_block_number(inode, first + oldBlocks, cursor))
+    oldBlocks++;
+  bool inPlace = oldBlocks == CLUSTER_BLOCKS && nblocks == CLUSTER_BLOCKS;
+
+  // The new blocks and the mapping blocks to point at them are all found
+  // before anything changes; if the disk is full, the new blocks are freed
+  // again and the cluster is left as it was
+  for (int j = 0; j < nblocks; ++j) {
+    int depth;
+    blocks[j] = inPlace ? data_block_number(inode, first + j, cursor)
+                        : find_free_iblock();
+    if (!blocks[j] ||
+        !block_pointer(inode, first + j, cursor, true, &depth)) {
+      for (int k = 0; k <= j && !inPlace; ++k)
+        if (blocks[k]) free_block(blocks[k]);
+      return false;
     }
-    return read_block((*indirect_block_ptr)[blockIndex - POINTERS_PER_INODE]);
   }
 
-  return read_block(blockNum);
-}
\ No newline at end of file
+  atomic<int> inFlight(0);
+  for (int j = 0; j < nblocks;) {
+    int run = 1;
+    while (j + run < nblocks && blocks[j + run] == blocks[j] + run) run++;
+    for (int k = j; k < j + run; ++k) {
+      cache.discard(blocks[k]);
+      readahead.invalidate(blocks[k]);
+      journal.revoke(blocks[k]);
+    }
+    inFlight++;
+    disk->submit_write_blocks(blocks[j], run,
+                              source + j * Disk::DISK_BLOCK_SIZE,
+                              [&inFlight]() { inFlight--; });
+    j += run;
+  }
+  while (inFlight) disk->poll(true);
+
+  if (!inPlace) {
+    for (int j = 0; j < CLUSTER_BLOCKS; ++j) {
+      unmap_block(inode, first + j, cursor);
+      if (j >= nblocks) continue;
+      int depth;
+      *block_pointer(inode, first + j, cursor, false, &depth) = blocks[j];
+      if (depth) cursor->dirty[depth - 1] = true;
+    }
+  }
+  return true;
+}
+
+int INE5412_FS::read_compressed(INE5412_FS::fs_inode *inode, char *data,
+                                int length, int offset,
+                                INE5412_FS::map_cursor *cursor) {
+  // Whole clusters are decompressed straight into data
+  vector<char> plain;
+  int bytesRead = 0;
+  while (bytesRead < length) {
+    int cluster = (offset + bytesRead) / CLUSTER_SIZE;
+    int clusterOffset = (offset + bytesRead) % CLUSTER_SIZE;
+    int n = min(length - bytesRead, CLUSTER_SIZE - clusterOffset);
+
+    if (n == CLUSTER_SIZE) {
+      read_cluster(inode, cluster, data + bytesRead, cursor);
+    } else {
+      plain.resize(CLUSTER_SIZE);
+      read_cluster(inode, cluster, plain.data(), cursor);
+      memcpy(data + bytesRead, plain.data() + clusterOffset, n);
+    }
+    bytesRead += n;
+  }
+  return bytesRead;
+}
+
+int INE5412_FS::write_compressed(INE5412_FS::fs_inode *inode,
+                                 const char *data, int length, int offset,
+                                 INE5412_FS::map_cursor *cursor) {
+  vector<char> plain;
+  int bytesWritten = 0;
+  while (bytesWritten < length) {
+    int cluster = (offset + bytesWritten) / CLUSTER_SIZE;
+    int clusterOffset = (offset + bytesWritten) % CLUSTER_SIZE;
+    int n = min(length - bytesWritten, CLUSTER_SIZE - clusterOffset);
+
+    const char *source = data + bytesWritten;
+    if (n < CLUSTER_SIZE) {
+      plain.resize(CLUSTER_SIZE);
+      read_cluster(inode, cluster, plain.data(), cursor);
+      memcpy(plain.data() + clusterOffset, source, n);
+      source = plain.data();
+    }
+
+    if (!write_cluster(inode, cluster, source, cursor)) {
+      cout << "Error: Disk Full!!\n";
+      break;
+    }
+    bytesWritten += n;
+  }
+
+  // update inode size if necessary; a write that failed leaves it as it
+  // was, even past the end
+  if (bytesWritten && offset + bytesWritten > inode->size)
+    inode->size = offset + bytesWritten;
+  return bytesWritten;
+}
@@ -2,18 +2,70 @@
 #define FS_H
 
 #include <algorithm>
+#include <atomic>
+#include <climits>
 #include <iterator>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <shared_mutex>
+#include <sys/uio.h>
 #include <utility>
 #include <vector>
 
+#include "bitmap.h"
+#include "cache.h"
 #include "disk.h"
+#include "journal.h"
+#include "readahead.h"
+#include "trace.h"
+#include "writebuf.h"
+
+/**
+ * The file system may be used from several threads at once. Every
+ * operation holds op_lock shared for as long as it runs, and a reader or
+ * writer lock on its inode (one of INODE_LOCK_STRIPES, picked by inode
+ * number); fs_mount, fs_umount, fs_format, fs_sync, fs_debug and the
+ * flushes and commits done between operations hold op_lock exclusively.
+ * Inode blocks are loaded under a lock of their own, and the bitmaps are
+ * changed under alloc_lock.
+ */
 class INE5412_FS {
  public:
   static const unsigned int FS_MAGIC = 0xf0f03410;
+  static const int FS_VERSION = 8;
   static const unsigned short int INODES_PER_BLOCK = 128;
+  static const unsigned short int LARGE_INODE_SIZE = 512;
+  static const unsigned short int LARGE_INODES_PER_BLOCK =
+      Disk::DISK_BLOCK_SIZE / LARGE_INODE_SIZE;
   static const unsigned short int POINTERS_PER_INODE = 5;
   static const unsigned short int POINTERS_PER_BLOCK = 1024;
+  static const unsigned short int INODE_SCAN_BLOCKS = 32;
+  static const unsigned short int INODE_FLUSH_BLOCKS = 64;
+  static const unsigned short int MAX_SCAN_THREADS = 8;
+  static const unsigned short int INLINE_EXTENTS = 2;
+  static const unsigned short int EXTENTS_PER_BLOCK = 512;
+  static const unsigned short int MAP_LEVELS = 3;
+  static const unsigned short int INODE_LOCK_STRIPES = 256;
+  static const unsigned short int STREAM_CHUNK_BLOCKS = 256;
+  static const unsigned short int INLINE_DATA_SIZE =
+      (POINTERS_PER_INODE + 1) * sizeof(int);
+  static const unsigned short int INLINE_TAIL_SIZE =
+      LARGE_INODE_SIZE - 2 * sizeof(int) - INLINE_DATA_SIZE;
+  static const unsigned short int CLUSTER_BLOCKS = 8;
+  static const int CLUSTER_SIZE = CLUSTER_BLOCKS * Disk::DISK_BLOCK_SIZE;
+
+  // Flags kept in fs_inode::isvalid
+  static const int INODE_VALID = 1;
+  static const int INODE_EXTENTS = 2;
+  static const int INODE_MULTILEVEL = 4;
+  static const int INODE_INLINE = 8;
+  static const int INODE_COMPRESSED = 16;
+
+  // Values of fs_superblock::clean
+  static const int FS_DIRTY = 0;
+  static const int FS_CLEAN = 1;
+  static const int FS_JOURNALED = 2;
 
   class fs_superblock {
    public:
@@ -21,49 +73,297 @@ class INE5412_FS {
     int nblocks;
     int ninodeblocks;
     int ninodes;
+
+    // Disks formatted before these fields existed have them all zero, which
+    // is version 0: no bitmaps on disk, so every mount scans the inodes.
+    int version;
+    // The free-block bitmap starts right after the inode table and is
+    // followed by the free-inode bitmap.
+    int bitmapstart;
+    int nbitmapblocks;
+    int ninodebitmapblocks;
+    // FS_CLEAN after fs_umount. While mounted, FS_JOURNALED if metadata
+    // goes through the journal, whose replay makes the bitmaps on disk
+    // current again, and FS_DIRTY otherwise: the bitmaps are then rebuilt
+    // by the next mount.
+    int clean;
+    // Version 4 disks keep a metadata journal between the bitmaps and the
+    // data (none on disks too small for one). Files on version 5 disks may
+    // have holes, those on version 6 disks may keep their data in the inode
+    // and those on version 7 disks may be compressed. Version 8 disks have
+    // inodes of LARGE_INODE_SIZE bytes.
+    int journalstart;
+    int njournalblocks;
   };
 
+  // A run of length blocks starting at block start.
+  class fs_extent {
+   public:
+    int start;
+    int length;
+  };
+
+  // Inodes with INODE_EXTENTS set (created on version 2 disks) map the file
+  // as a list of extents instead of one pointer per block: the first
+  // INLINE_EXTENTS in the inode itself, the rest in the block indirect
+  // points to.
+  //
+  // Pointer inodes with INODE_MULTILEVEL set (created on version 3 disks)
+  // give up the last two direct pointers for a double and a triple indirect
+  // block, which lifts the file size limit from 5 + 1024 blocks to the
+  // largest size an int can hold.
+  //
+  // A hole is a run of blocks with no disk block, which reads as zeros: a
+  // zero pointer in a pointer inode and an extent starting at block 0, the
+  // superblock, in an extent inode.
+  //
+  // Inodes with INODE_INLINE set (created on version 6 disks) hold the data
+  // of the file itself, in the space of the pointers, for as long as it
+  // fits in INLINE_DATA_SIZE bytes. On version 8 disks each inode is
+  // followed by INLINE_TAIL_SIZE more bytes for the data (see
+  // fs_large_inode), so files of a few hundred bytes fit. A file that grows
+  // past that moves to a data block and is mapped as its other flags say
+  // from then on.
+  //
+  // Inodes with INODE_COMPRESSED set (on version 7 disks) are pointer inodes
+  // whose data is kept in clusters of CLUSTER_BLOCKS blocks. Cluster c is
+  // mapped by blocks c * CLUSTER_BLOCKS on: all of them if it is stored as
+  // it is, none if it is all zeros, and otherwise the first few, which hold
+  // its length once compressed, as an int, and the compressed bytes. The
+  // rest of the cluster is a hole.
   class fs_inode {
    public:
     int isvalid;
     int size;
-    int direct[POINTERS_PER_INODE];
-    int indirect;
+    union {
+      struct {
+        union {
+          int direct[POINTERS_PER_INODE];
+          struct {
+            fs_extent extents[INLINE_EXTENTS];
+            int nextents;
+          };
+          struct {
+            int multilevel_direct[POINTERS_PER_INODE - 2];
+            int double_indirect;
+            int triple_indirect;
+          };
+        };
+        int indirect;
+      };
+      // Zero past the end of the file
+      char inline_data[INLINE_DATA_SIZE];
+    };
+  };
+
+  // An inode of a version 8 disk. The tail continues the inline data of an
+  // INODE_INLINE inode and is unused otherwise.
+  class fs_large_inode {
+   public:
+    fs_inode inode;
+    char inline_tail[INLINE_TAIL_SIZE];
   };
 
   union fs_block {
    public:
     fs_superblock super;
     fs_inode inode[INODES_PER_BLOCK];
+    fs_large_inode large_inode[LARGE_INODES_PER_BLOCK];
     int pointers[POINTERS_PER_BLOCK];
+    fs_extent extents[EXTENTS_PER_BLOCK];
     char data[Disk::DISK_BLOCK_SIZE];
   };
 
+  // What fs_stat reports about a file.
+  class fs_stat_info {
+   public:
+    int size;
+    // Data blocks allocated to the file, not counting mapping blocks but
+    // counting those reserved past its end.
+    int blocks;
+    // The inode flags: INODE_VALID, INODE_EXTENTS, INODE_MULTILEVEL,
+    // INODE_INLINE, INODE_COMPRESSED.
+    int flags;
+  };
+
  public:
-  INE5412_FS(Disk *d) {
+  INE5412_FS(Disk *d, int cache_blocks = Block_Cache::DEFAULT_CAPACITY,
+             bool extents = true)
+      : cache(d, cache_blocks),
+        readahead(d),
+        writebuf(d),
+        journal(d, &cache),
+        tracer(d) {
     disk = d;
+    create_extents = extents;
 
     fs_block block;
-    this->disk->read(0, block.data);
+    this->cache.read(0, block.data);
     this->superblock = block.super;
+
+    // A transaction the journal writes in place leaves the disk to be
+    // checked by the next mount until it is all written.
+    journal.set_overflow_hook([this](bool writing) {
+      write_clean_state(writing ? FS_DIRTY : FS_JOURNALED);
+    });
+
+    // Inodes and bitmaps changed while mounted must reach the cache before
+    // it is flushed on close.
+    disk->add_close_hook([this]() {
+      if (mounted) fs_umount();
+    });
   }
 
   void fs_debug();
   int fs_format();
   int fs_mount();
   int fs_umount();
+  /**
+   * Write every buffered change to the disk without unmounting it.
+   */
+  int fs_sync();
   int fs_create();
+  /**
+   * Create up to count inodes at once, storing their numbers in inumbers,
+   * and return how many were created. Inodes are taken in order, so they
+   * fill whole inode blocks, each written once.
+   */
+  int fs_create_many(int count, int *inumbers);
   int fs_delete(int inumber);
   int fs_getsize(int inumber);
+  /**
+   * Fill info for file inumber. Returns 0 if it is not a valid file.
+   */
+  int fs_stat(int inumber, fs_stat_info *info);
+
+  /**
+   * Reserve the blocks for the first length bytes of file inumber without
+   * writing them or changing its size. Writes that later grow the file into
+   * them use them instead of allocating, and an extent inode gets them as
+   * one run if the disk has one. Holes in the range are filled with zeroed
+   * blocks. If the disk fills up, the blocks reserved so far are kept and 0
+   * is returned. Compressed files, whose size on disk is not known before
+   * the data is, cannot have blocks reserved.
+   */
+  int fs_fallocate(int inumber, int length);
+  /**
+   * Shrink file inumber to length bytes, freeing its blocks past the new
+   * end, including those reserved by fs_fallocate. Truncating a file to its
+   * own size just gives back the reserved blocks. On disks that allow holes
+   * the file may also grow, the new bytes being a hole.
+   */
+  int fs_truncate(int inumber, int length);
+
+  /**
+   * Make the empty file inumber compressed, on disks that allow it: from
+   * then on its data is stored compressed in clusters of CLUSTER_SIZE
+   * bytes, each rewritten whole when any of it changes and read whole to
+   * get any of it.
+   */
+  int fs_compress(int inumber);
 
   int fs_read(int inumber, char *data, int length, int offset);
+  /**
+   * Write length bytes of data into file inumber at offset. On disks that
+   * allow holes, offset may lie past the end of the file, leaving a hole
+   * before the data, and whole blocks of zeros written over a hole stay
+   * unallocated.
+   */
   int fs_write(int inumber, const char *data, int length, int offset);
 
+  /**
+   * Scatter/gather versions of fs_read and fs_write: the iovcnt buffers of
+   * iov are read or written in turn, as one call on the bytes starting at
+   * offset. Whole blocks go straight between the disk and the buffers.
+   */
+  int fs_readv(int inumber, const struct iovec *iov, int iovcnt, int offset);
+  int fs_writev(int inumber, const struct iovec *iov, int iovcnt, int offset);
+
+  /**
+   * Write length bytes into file inumber starting at offset, for bulk
+   * imports whose size is known up front. The bytes are asked for in chunks
+   * of up to STREAM_CHUNK_BLOCKS blocks by calling fill(buffer, n), which
+   * stores the next n bytes in buffer and returns how many it stored; fewer
+   * than n ends the stream. All the blocks are mapped first, as contiguous
+   * as the disk allows, the next chunk is filled while the previous one is
+   * written, and the inode and mapping blocks are written once at the end.
+   * Blocks mapped for bytes fill never gave stay with the file, past its end.
+   */
+  int fs_write_stream(int inumber, int offset, int length,
+                      function<int(char *, int)> fill);
+
+  /**
+   * Records the calls made to this file system while started.
+   */
+  Trace_Recorder *recorder() { return &tracer; }
+
  private:
   Disk *disk;
+  Block_Cache cache;
+  Read_Ahead readahead;
+  Write_Buffer writebuf;
+  Journal journal;
+  Trace_Recorder tracer;
   fs_superblock superblock;
   bool mounted = false;
-  vector<bool> free_blocks;
+
+  shared_mutex op_lock;
+  shared_mutex inode_locks[INODE_LOCK_STRIPES];
+  mutex inode_block_locks[INODE_LOCK_STRIPES];
+  // Guards free_blocks, free_inodes and freed_blocks.
+  mutex alloc_lock;
+  // Guards dirty_inode_blocks.
+  mutex meta_lock;
+  // Set by an operation that found work for finish_operation to do.
+  atomic<bool> maintenance_due{false};
+  atomic<bool> commit_due{false};
+
+  /**
+   * Held for the length of every file operation. On destruction, does the
+   * maintenance the operation found due.
+   */
+  class op_guard {
+   public:
+    op_guard(INE5412_FS *f) : fs(f), lock(f->op_lock, defer_lock) {
+      // A commit found due by another operation is done before this one
+      // adds to the transaction, so that it does not outgrow the log
+      if (fs->commit_due) fs->finish_operation();
+      lock.lock();
+    }
+    ~op_guard() {
+      lock.unlock();
+      fs->finish_operation();
+    }
+
+   private:
+    INE5412_FS *fs;
+    shared_lock<shared_mutex> lock;
+  };
+
+  shared_mutex &inode_lock(int inumber) {
+    return inode_locks[inumber % INODE_LOCK_STRIPES];
+  }
+
+  // Whether fs_create maps new files with extents (on disks that have them)
+  // rather than with block pointers.
+  bool create_extents;
+  Block_Bitmap free_blocks;
+  Block_Bitmap free_inodes;
+
+  // Every inode of the disk, loaded one inode block at a time on first use
+  // (or all at once by a scanning mount). Changes are made here and written
+  // back one inode block at a time by flush_inodes.
+  vector<fs_inode> inode_table;
+  vector<atomic<bool>> inode_block_loaded;
+  // The inline tails of the inodes of a version 8 disk, INLINE_TAIL_SIZE
+  // bytes each, in the order of inode_table and loaded along with it.
+  vector<char> inline_tails;
+  set<int> dirty_inode_blocks;
+
+  // Blocks freed while the journal is running, kept from being reused until
+  // the next commit: until then the committed metadata may still point to
+  // them.
+  vector<int> freed_blocks;
 
   /**
    * Find if inumber is valid
@@ -76,34 +376,481 @@ class INE5412_FS {
    * Find block in which inode is stored
    */
   int find_inode_block(int inumber) {
-    return 1 + (inumber - 1) / INODES_PER_BLOCK;
+    return 1 + (inumber - 1) / inodes_per_block();
   }
 
   /**
    * Find inode position inside a block.
    */
   int find_inode_offset(int inumber) {
-    return (inumber - 1) % INODES_PER_BLOCK;
+    return (inumber - 1) % inodes_per_block();
   }
 
   /**
-   * Given a block number, read it from the disk.
+   * Return the in-memory copy of inode inumber. An inode block in which the
+   * free inode bitmap has no inode in use is not read: all its inodes are
+   * invalid, which is all that matters about them.
    */
-  fs_block read_block(int blocknum) {
-    fs_block block;
-    this->disk->read(blocknum, block.data);
-    return block;
+  fs_inode *get_inode(int inumber) {
+    int block = find_inode_block(inumber);
+    if (!inode_block_loaded[block]) {
+      lock_guard<mutex> lock(inode_block_locks[block % INODE_LOCK_STRIPES]);
+      if (!inode_block_loaded[block]) {
+        int per_block = inodes_per_block();
+        int first = (block - 1) * per_block;
+        bool empty;
+        {
+          lock_guard<mutex> alloc(alloc_lock);
+          empty = free_inodes.run_length(first, per_block) == per_block;
+        }
+        if (empty) {
+          fill_n(inode_table.begin() + first, per_block, fs_inode());
+          inode_block_loaded[block] = true;
+        } else {
+          fs_block buffer;
+          load_inode_block(block, read_block(block, &buffer));
+        }
+      }
+    }
+    return &inode_table[inumber - 1];
+  }
+
+  bool uses_extents(const fs_inode *inode) {
+    return inode->isvalid & INODE_EXTENTS;
+  }
+
+  bool is_multilevel(const fs_inode *inode) {
+    return inode->isvalid & INODE_MULTILEVEL;
+  }
+
+  bool is_inline(const fs_inode *inode) {
+    return inode->isvalid & INODE_INLINE;
+  }
+
+  bool is_compressed(const fs_inode *inode) {
+    return inode->isvalid & INODE_COMPRESSED;
+  }
+
+  bool has_large_inodes() { return superblock.version >= 8; }
+
+  int inodes_per_block() {
+    return has_large_inodes() ? LARGE_INODES_PER_BLOCK : INODES_PER_BLOCK;
+  }
+
+  /**
+   * Most bytes an inline inode holds.
+   */
+  int inline_capacity() {
+    return has_large_inodes() ? INLINE_DATA_SIZE + INLINE_TAIL_SIZE
+                              : INLINE_DATA_SIZE;
+  }
+
+  /**
+   * Inode j of inode block block, as laid out on this disk.
+   */
+  fs_inode *block_inode(fs_block *block, int j) {
+    return has_large_inodes() ? &block->large_inode[j].inode
+                              : &block->inode[j];
+  }
+  const fs_inode *block_inode(const fs_block *block, int j) {
+    return block_inode(const_cast<fs_block *>(block), j);
+  }
+
+  /**
+   * Inline tail of inode, which has to be in inode_table, on a version 8
+   * disk.
+   */
+  char *inline_tail(const fs_inode *inode) {
+    return inline_tails.data() +
+           (size_t)(inode - inode_table.data()) * INLINE_TAIL_SIZE;
+  }
+
+  // Older code does not know holes, so only version 5 disks have them
+  bool supports_holes() { return superblock.version >= 5; }
+
+  /**
+   * Whether block block_index of inode lies wholly past its end, so that
+   * what it holds does not matter.
+   */
+  bool past_end(const fs_inode *inode, int block_index) {
+    return (long)block_index * Disk::DISK_BLOCK_SIZE >= inode->size;
+  }
+
+  /**
+   * Largest size, in bytes, that inode can grow to.
+   */
+  long max_file_size(const fs_inode *inode);
+
+  /**
+   * The mapping blocks of one file last used at each depth: for a pointer
+   * inode the indirect blocks on the path to the last data block looked up
+   * (depth 0 being the one the inode points to), for an extent inode its
+   * extent block at depth 0. Walking a file in order therefore reads each
+   * mapping block once. Changed blocks are written back when they are
+   * replaced and by flush_map.
+   */
+  struct map_cursor {
+    int blocknum[MAP_LEVELS] = {};
+    bool dirty[MAP_LEVELS] = {};
+    fs_block block[MAP_LEVELS];
+  };
+
+  /**
+   * Make blocknum the mapping block of cursor at depth and return it.
+   */
+  fs_block *load_map_block(map_cursor *cursor, int depth, int blocknum);
+
+  /**
+   * Allocate a zeroed mapping block as the one of cursor at depth and return
+   * its number, or 0 if the disk is full.
+   */
+  int new_map_block(map_cursor *cursor, int depth);
+
+  /**
+   * Write back the changed mapping blocks of cursor.
+   */
+  void flush_map(map_cursor *cursor);
+
+  /**
+   * Find the block holding block block_index of a pointer inode. If it does
+   * not exist and allocate is set, allocate it and the indirect blocks
+   * leading to it, otherwise return 0.
+   */
+  int map_block(fs_inode *inode, int block_index, map_cursor *cursor,
+                bool allocate);
+
+  /**
+   * Find the pointer to block block_index of a pointer inode, in the inode
+   * or in a mapping block of cursor at depth - 1, or null if the mapping
+   * blocks leading to it do not exist and allocate is not set.
+   */
+  int *block_pointer(fs_inode *inode, int block_index, map_cursor *cursor,
+                     bool allocate, int *depth);
+
+  /**
+   * Free block block_index of a pointer inode, leaving a hole.
+   */
+  void unmap_block(fs_inode *inode, int block_index, map_cursor *cursor);
+
+  /**
+   * Free blocknum and, for a mapping block at depth levels above the data,
+   * every block under it.
+   */
+  void free_map_tree(int blocknum, int depth);
+
+  /**
+   * Number of data blocks mapped by inode, past its end too.
+   */
+  int count_blocks(fs_inode *inode, map_cursor *cursor);
+
+  /**
+   * Number of data blocks under mapping block blocknum, which is depth
+   * levels above the data.
+   */
+  int count_map_tree(int blocknum, int depth);
+
+  /**
+   * Free every data block of inode from block index nblocks on, and the
+   * mapping blocks that only led to them.
+   */
+  void truncate_blocks(fs_inode *inode, int nblocks);
+
+  /**
+   * Free the blocks from block index nblocks on under *pointer, the root of
+   * a tree depth levels above the data whose first block has index first,
+   * clearing the pointers to them. Returns whether *pointer or the blocks
+   * under it changed.
+   */
+  bool truncate_map_tree(int *pointer, int depth, long first, int nblocks);
+
+  /**
+   * Print the data blocks under mapping block blocknum for fs_debug.
+   */
+  void debug_map_tree(int blocknum, int depth, ostream &out);
+
+  /**
+   * Return the extent block of an extent inode, read through cursor, or
+   * null when all its extents fit in the inode.
+   */
+  fs_extent *load_extents(fs_inode *inode, map_cursor *cursor);
+
+  /**
+   * Return extent number index of an extent inode, whose extent block
+   * holds more.
+   */
+  static const fs_extent &get_extent(const fs_inode &inode,
+                                     const fs_extent *more, int index) {
+    return index < INLINE_EXTENTS ? inode.extents[index]
+                                  : more[index - INLINE_EXTENTS];
+  }
+  static fs_extent &get_extent(fs_inode &inode, fs_extent *more, int index) {
+    return index < INLINE_EXTENTS ? inode.extents[index]
+                                  : more[index - INLINE_EXTENTS];
+  }
+
+  /**
+   * Find the disk block holding block block_index of an extent inode, or 0
+   * if the extents do not reach that far.
+   */
+  int extent_lookup(const fs_inode *inode, const fs_extent *more,
+                    int block_index);
+
+  /**
+   * Allocate the next block of an extent inode: the block right after the
+   * last extent if it is free, otherwise the start of a new extent, placed
+   * where wanted contiguous blocks are free if there is such a place. The
+   * extent block is read or created through cursor.
+   */
+  int append_extent_block(fs_inode *inode, int wanted, map_cursor *cursor);
+
+  /**
+   * Make room for count extents at index of an extent inode, creating its
+   * extent block if they no longer fit in the inode. Returns false if they
+   * do not fit at all or the disk is full.
+   */
+  bool insert_extents(fs_inode *inode, int index, int count,
+                      map_cursor *cursor);
+
+  /**
+   * Remove extent number index of an extent inode, freeing its extent block
+   * once the inode holds the rest.
+   */
+  void remove_extent(fs_inode *inode, int index, map_cursor *cursor);
+
+  /**
+   * Map length more blocks of an extent inode as a hole. Returns false if
+   * there is no room for the extent.
+   */
+  bool append_extent_hole(fs_inode *inode, int length, map_cursor *cursor);
+
+  /**
+   * Allocate the block at offset in the hole that is extent number index of
+   * an extent inode, growing the data extent before it when offset is 0 and
+   * splitting the hole otherwise. wanted is as for append_extent_block.
+   */
+  int fill_extent_hole(fs_inode *inode, int index, int offset, int wanted,
+                       map_cursor *cursor);
+
+  /**
+   * Allocate block block_index of inode, which has none: a pointer through
+   * map_block, an extent block in the hole it falls in or, past the last
+   * extent, after a hole covering the blocks in between. Returns 0 if the
+   * disk is full.
+   */
+  int allocate_block(fs_inode *inode, int block_index, int wanted,
+                     map_cursor *cursor);
+
+  /**
+   * Make the bytes of file inumber from offset from up to to read as zeros,
+   * as they must once the file grows over them. Its size is left as it is,
+   * for the caller to grow once the write past the end has succeeded.
+   */
+  void zero_range(int inumber, fs_inode *inode, int from, int to,
+                  map_cursor *cursor);
+
+  static bool is_zero(const char *data, int length);
+
+  /**
+   * Move the data of an inline inode to a data block of its own, mapped
+   * through cursor. Returns false, leaving the inode as it was, if the disk
+   * is full.
+   */
+  bool promote_inline(int inumber, fs_inode *inode, map_cursor *cursor);
+
+  /**
+   * Copy length bytes of the inline data of inode from offset on into data,
+   * or from data into the inode, whose pointer area and tail hold it as one
+   * run of inline_capacity() bytes. A null data writes zeros.
+   */
+  void read_inline(const fs_inode *inode, char *data, int length,
+                   int offset);
+  void write_inline(fs_inode *inode, const char *data, int length,
+                    int offset);
+
+  /**
+   * Read cluster number cluster of a compressed inode, decompressed, into
+   * plain, which holds CLUSTER_SIZE bytes.
+   */
+  void read_cluster(fs_inode *inode, int cluster, char *plain,
+                    map_cursor *cursor);
+
+  /**
+   * Store the CLUSTER_SIZE bytes of plain as cluster number cluster of a
+   * compressed inode, in new blocks unless it was and stays stored raw.
+   * Returns false, with the cluster left as it was, if the disk is full.
+   */
+  bool write_cluster(fs_inode *inode, int cluster, const char *plain,
+                     map_cursor *cursor);
+
+  /**
+   * read_range and write_range of a compressed inode, a cluster at a time.
+   * Partly written clusters are read first.
+   */
+  int read_compressed(fs_inode *inode, char *data, int length, int offset,
+                      map_cursor *cursor);
+  int write_compressed(fs_inode *inode, const char *data, int length,
+                       int offset, map_cursor *cursor);
+
+  /**
+   * Copy the inodes of inode block blocknum into the inode table.
+   */
+  void load_inode_block(int blocknum, const fs_block *block);
+
+  /**
+   * Build inode block blocknum from the inode table.
+   */
+  void store_inode_block(int blocknum, fs_block *block);
+
+  /**
+   * First block after the superblock, inode table and bitmaps.
+   */
+  int first_data_block();
+
+  /**
+   * Rebuild the free block and free inode bitmaps from the inode table,
+   * loading all of it. Used for version 0 disks and for disks that were not
+   * unmounted cleanly. The inode blocks are split among several threads,
+   * each building its own map of used blocks; the maps are merged at the
+   * end. Blocks used more than once and pointers outside the data area are
+   * reported.
+   */
+  void scan_inodes();
+
+  /**
+   * Split inode blocks 1 to ninodeblocks into consecutive ranges and run
+   * work(thread, first, last) for each range on its own thread. Returns the
+   * number of threads used.
+   */
+  int parallel_scan(int first, int last,
+                    function<void(int, int, int)> work);
+
+  /**
+   * Read blocknum straight from the disk, the same way as
+   * read_block(int, fs_block *) but without the cache, so that it can be
+   * called from scan threads. The cache must not hold dirty blocks.
+   */
+  const fs_block *read_block_direct(int blocknum, fs_block *buffer);
+
+  /**
+   * Print the inodes of one inode block for fs_debug.
+   */
+  void debug_inode_block(int blocknum, const fs_block *block, ostream &out);
+
+  /**
+   * Load the bitmaps stored on disk.
+   */
+  void load_bitmaps();
+
+  /**
+   * Write the bitmap blocks changed since they were loaded or last written.
+   */
+  void flush_bitmaps();
+
+  /**
+   * Write the in-memory superblock to block 0.
+   */
+  void write_superblock();
+
+  /**
+   * Set superblock.clean and write the superblock straight to the disk,
+   * synced, past the cache (which would hold it back for the journal).
+   */
+  void write_clean_state(int clean);
+
+  /**
+   * Called at the end of every operation that changes metadata. When the
+   * journal is running, ask for a commit once enough operations have been
+   * gathered.
+   */
+  void end_operation();
+
+  /**
+   * Run by op_guard once an operation has released its locks: if the
+   * operation found a commit or flush due, take op_lock exclusively and do
+   * it.
+   */
+  void finish_operation();
+
+  /**
+   * Commit, flush the inode table and flush the write buffer if due. op_lock
+   * must be held exclusively.
+   */
+  void maintain();
+
+  /**
+   * Write the changed inodes and bitmaps to the cache and commit them, with
+   * every other metadata block changed since the last commit, as one
+   * journal transaction.
+   */
+  void commit_metadata();
+
+  /**
+   * Record that inode inumber was changed and must be written back.
+   */
+  void mark_inode_dirty(int inumber);
+
+  /**
+   * Write every inode block holding a changed inode.
+   */
+  void flush_inodes();
+
+  /**
+   * Given a block number, read it from the disk. On a mapped disk the result
+   * points straight into the mapping and buffer is not touched, otherwise
+   * the block is read into buffer.
+   */
+  const fs_block *read_block(int blocknum, fs_block *buffer) {
+    if (char *mapped = disk->map(blocknum)) return (const fs_block *)mapped;
+    this->cache.read(blocknum, buffer->data);
+    return buffer;
   }
 
   /**
    * Given an inode and an offset inside it, read the block defined by the
-   * offset. If an indirect block is necessary and indirect_block_ptr is null,
-   * read it from disk and write to indirect_block_ptr, else read the indirect
-   * block from the pointer.
+   * offset, the same way as read_block(int, fs_block *). The mapping blocks
+   * needed to find it are read through cursor.
+   */
+  const fs_block *read_block(fs_inode *inode, int offset, map_cursor *cursor,
+                             fs_block *buffer);
+
+  /**
+   * Read up to length bytes of file inumber starting at offset into data,
+   * stopping at the end of the file, and return how many were read. The
+   * mapping blocks are read through cursor. The inode lock must be held.
    */
-  fs_block read_block(fs_inode *inode, int offset, int **indirect_block_ptr);
+  int read_range(int inumber, fs_inode *inode, char *data, int length,
+                 int offset, map_cursor *cursor);
 
-  optional<pair<int, fs_block>> find_free_inode();
+  /**
+   * Write length bytes of data into file inumber starting at offset, which
+   * must not be past its end, growing it as needed, and return how many were
+   * written. The mapping blocks are changed through cursor, and the caller
+   * writes them and the inode back. The inode lock must be held exclusively.
+   */
+  int write_range(int inumber, fs_inode *inode, const char *data, int length,
+                  int offset, map_cursor *cursor);
+
+  /**
+   * Total length of the buffers of iov, at most INT_MAX.
+   */
+  static int iov_length(const struct iovec *iov, int iovcnt);
+
+  /**
+   * Find the number of the block_index-th data block of inode, or 0 if it
+   * has none. The mapping blocks are read through cursor.
+   */
+  int data_block_number(fs_inode *inode, int block_index, map_cursor *cursor);
+
+  /**
+   * Take the first free inode at or after inode from + 1, marking it as
+   * used, with its inode block loaded.
+   */
+  optional<int> find_free_inode(int from = 0);
+
+  /**
+   * Turn newly taken inode inumber into an empty file.
+   */
+  void init_inode(int inumber);
 
   /**
    * Find if disk can be used by other functions besides debug, mount and
@@ -113,23 +860,15 @@ class INE5412_FS {
   bool is_usable(int inumber);
 
   /**
-   * Find free block on the disk and return it's number.
+   * Mark blocknum as free, or as free after the next commit while the
+   * journal is running.
    */
-  int find_free_iblock();
+  void free_block(int blocknum);
 
   /**
-   * Allocate a block used to store data.
-   * If an indirect block is necessary and indirect_block is null, read it from
-   * disk and write to indirect_block, else read the indirect block from the
-   * pointer.
+   * Find free block on the disk, mark it as used and return it's number.
    */
-  int allocate_data_block(fs_inode *inode, int block_index,
-                          fs_block **indirect_block);
-
-  /**
-   * Allocate indirect block to inode.
-   */
-  int allocate_indirect_block(fs_inode *inode);
+  int find_free_iblock();
 };
 
 #endif
@@ -0,0 +1,265 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+Journal::Journal(Disk *d, Block_Cache *c) {
+  disk = d;
+  cache = c;
+  active = false;
+  first = count = head = 0;
+  sequence = 1;
+  max_batch = 0;
+  operations = 0;
+  ncommits = 0;
+  ncommitted_operations = 0;
+  ncommitted_blocks = 0;
+  ncheckpoints = 0;
+  noverflows = 0;
+
+  disk->add_close_hook([this]() { report(); });
+}
+
+int Journal::blocks_for(int nblocks) {
+  int n = min(nblocks / 16, (int)MAX_BLOCKS);
+  return n < MIN_BLOCKS ? 0 : n;
+}
+
+void Journal::format(int f, int n) {
+  first = f;
+  count = n;
+  sequence = 1;
+
+  // Nothing left over from an earlier file system may look like a
+  // transaction
+  vector<char> zero((size_t)n * Disk::DISK_BLOCK_SIZE, 0);
+  for (int i = 0; i < n; ++i) cache->discard(first + i);
+  disk->write_blocks(first, n, zero.data());
+  write_header();
+}
+
+int Journal::replay(int f, int n) {
+  first = f;
+  count = n;
+
+  // The log is emptied once it has been applied
+  int found;
+  sequence = scan(true, &found);
+  write_header();
+  disk->sync();
+  return found;
+}
+
+void Journal::start(int f, int n) {
+  first = f;
+  count = n;
+  max_batch = min((int)(sizeof(descriptor::blocks) / sizeof(int)), count - 3);
+
+  // Begin after everything already in the log, so that none of it is
+  // replayed again
+  int found;
+  sequence = scan(false, &found);
+  write_header();
+  disk->sync();
+
+  head = first + 1;
+  logged.clear();
+  operations = 0;
+  active = true;
+  cache->hold(true);
+}
+
+void Journal::stop() {
+  lock_guard<mutex> lock(m);
+  if (!active) return;
+  commit_held();
+  checkpoint();
+  cache->hold(false);
+  active = false;
+}
+
+bool Journal::add_operation() {
+  lock_guard<mutex> lock(m);
+  operations++;
+  return operations >= GROUP_OPERATIONS || cache->nheld() >= batch_limit();
+}
+
+void Journal::commit() {
+  lock_guard<mutex> lock(m);
+  commit_held();
+}
+
+void Journal::commit_held() {
+  if (!active) return;
+
+  vector<pair<int, const char *>> blocks = cache->held_blocks();
+  int n = blocks.size();
+  if (!n) {
+    operations = 0;
+    return;
+  }
+
+  // A transaction too large for the log is written in place instead, which
+  // is not atomic. What the log holds goes home first, since a mount that
+  // finds the disk marked by the hook does not replay it; the in-place
+  // writes then leave nothing older in the log to be replayed over them.
+  if (n > max_batch) {
+    checkpoint();
+    if (overflow_hook) overflow_hook(true);
+    cache->release_held();
+    checkpoint();
+    if (overflow_hook) overflow_hook(false);
+    noverflows++;
+    operations = 0;
+    return;
+  }
+
+  if (head + n + 2 > first + count) checkpoint();
+
+  descriptor d;
+  memset(&d, 0, sizeof(d));
+  d.magic = MAGIC;
+  d.sequence = sequence;
+  d.count = n;
+
+  vector<const char *> iov(n + 2);
+  iov[0] = (const char *)&d;
+  for (int i = 0; i < n; ++i) {
+    d.blocks[i] = blocks[i].first;
+    iov[i + 1] = blocks[i].second;
+  }
+
+  char record[Disk::DISK_BLOCK_SIZE];
+  memset(record, 0, sizeof(record));
+  commit_record *c = (commit_record *)record;
+  c->magic = MAGIC;
+  c->sequence = sequence;
+  c->count = n;
+  c->checksum = checksum(sequence, d.blocks, n, &iov[1]);
+  iov[n + 1] = record;
+
+  // One write for the whole transaction and one sync to commit it
+  disk->writev(head, n + 2, iov.data());
+  disk->sync();
+
+  for (auto &b : blocks) logged.insert(b.first);
+  cache->release_held();
+  head += n + 2;
+  sequence++;
+
+  ncommits++;
+  ncommitted_operations += operations;
+  ncommitted_blocks += n;
+  operations = 0;
+}
+
+void Journal::revoke(int blocknum) {
+  lock_guard<mutex> lock(m);
+  if (active && logged.count(blocknum)) checkpoint();
+}
+
+void Journal::checkpoint() {
+  // The held blocks of the running transaction stay in the cache
+  cache->flush();
+  disk->sync();
+
+  write_header();
+  disk->sync();
+
+  head = first + 1;
+  logged.clear();
+  ncheckpoints++;
+}
+
+void Journal::write_header() {
+  char block[Disk::DISK_BLOCK_SIZE];
+  memset(block, 0, sizeof(block));
+  header *h = (header *)block;
+  h->magic = MAGIC;
+  h->sequence = sequence;
+  disk->write(first, block);
+}
+
+unsigned int Journal::scan(bool apply, int *found) {
+  *found = 0;
+
+  char block[Disk::DISK_BLOCK_SIZE];
+  disk->read(first, block);
+  header h = *(header *)block;
+  if (h.magic != MAGIC) return 1;
+
+  unsigned int seq = h.sequence;
+  int end = first + count;
+  int pos = first + 1;
+  descriptor d;
+  vector<char> data;
+  vector<const char *> blocks;
+
+  while (pos + 2 <= end) {
+    disk->read(pos, (char *)&d);
+    int n = d.count;
+    if (d.magic != MAGIC || d.sequence != seq || n <= 0 ||
+        n > (int)(sizeof(d.blocks) / sizeof(int)) || pos + n + 2 > end)
+      break;
+
+    bool valid = true;
+    for (int i = 0; i < n; ++i)
+      if (d.blocks[i] <= 0 || d.blocks[i] >= disk->size() ||
+          (d.blocks[i] >= first && d.blocks[i] < end))
+        valid = false;
+    if (!valid) break;
+
+    data.resize((size_t)n * Disk::DISK_BLOCK_SIZE);
+    disk->read_blocks(pos + 1, n, data.data());
+    blocks.resize(n);
+    for (int i = 0; i < n; ++i)
+      blocks[i] = data.data() + (size_t)i * Disk::DISK_BLOCK_SIZE;
+
+    // A transaction whose commit block is missing or does not match was
+    // torn by the crash, and so is everything after it
+    disk->read(pos + n + 1, block);
+    commit_record c = *(commit_record *)block;
+    if (c.magic != MAGIC || c.sequence != seq || c.count != n ||
+        c.checksum != checksum(seq, d.blocks, n, blocks.data()))
+      break;
+
+    if (apply)
+      for (int i = 0; i < n; ++i) cache->write(d.blocks[i], blocks[i]);
+
+    pos += n + 2;
+    seq++;
+    (*found)++;
+  }
+
+  if (apply) {
+    cache->flush();
+    disk->sync();
+  }
+  return seq;
+}
+
+unsigned int Journal::checksum(unsigned int sequence, const int *blocks,
+                               int n, const char *const *data) {
+  // FNV-1a over the sequence number, the home locations and the contents
+  unsigned int hash = 2166136261u;
+  auto add = [&hash](const void *p, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)p;
+    for (size_t i = 0; i < len; ++i) hash = (hash ^ bytes[i]) * 16777619u;
+  };
+
+  add(&sequence, sizeof(sequence));
+  add(blocks, n * sizeof(int));
+  for (int i = 0; i < n; ++i) add(data[i], Disk::DISK_BLOCK_SIZE);
+  return hash;
+}
+
+void Journal::report() {
+  cout << ncommits << " journal commits\n";
+  cout << (ncommits ? ncommitted_operations / ncommits : 0)
+       << " operations per commit\n";
+  cout << (ncommits ? ncommitted_blocks / ncommits : 0)
+       << " blocks per commit\n";
+  cout << ncheckpoints << " journal checkpoints\n";
+  cout << noverflows << " journal overflows\n";
+}
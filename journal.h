@@ -0,0 +1,179 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <functional>
+#include <mutex>
+#include <unordered_set>
+
+#include "cache.h"
+#include "disk.h"
+
+/**
+ * Write-ahead journal for metadata blocks, kept in a region of the disk set
+ * up by fs_format. While the journal is running the cache holds every
+ * metadata block written to it (see Block_Cache::hold). The changes of many
+ * operations are gathered this way and committed together as one
+ * transaction: a descriptor block listing the home locations, the blocks
+ * themselves and a commit block carrying a checksum, written with a single
+ * vectored write and made durable with a single sync. Committed blocks are
+ * then released to the cache, which writes them to their home locations
+ * whenever it would anyway.
+ *
+ * The first block of the region is a header holding the sequence number of
+ * the first transaction in the log. When the log is full, a checkpoint
+ * writes every committed block home and restarts the log after the header
+ * with the next sequence number, so older transactions are never replayed.
+ * replay() applies the transactions of a disk that was not unmounted, up to
+ * the first one that is missing or torn.
+ *
+ * A transaction too large for the log cannot be committed atomically, so
+ * its blocks are written home in place instead. The overflow hook marks the
+ * disk as needing a full check for as long as those writes are under way.
+ *
+ * add_operation, commit and revoke may be called from several threads; the
+ * caller makes sure that no operation is changing metadata while commit
+ * runs, so that each transaction holds whole operations.
+ */
+class Journal {
+ public:
+  static const unsigned int MAGIC = 0x4a524e4c;
+  static const int MAX_BLOCKS = 256;
+  static const int MIN_BLOCKS = 8;
+  // Operations gathered into one transaction before it is committed.
+  static const int GROUP_OPERATIONS = 32;
+
+  Journal(Disk *d, Block_Cache *c);
+
+  /**
+   * Number of journal blocks fs_format reserves on a disk of nblocks, or 0
+   * if the disk is too small to have one.
+   */
+  static int blocks_for(int nblocks);
+
+  /**
+   * Zero the journal region of count blocks starting at first.
+   */
+  void format(int first, int count);
+
+  /**
+   * Apply the committed transactions found in the journal region, empty the
+   * log and return how many there were.
+   */
+  int replay(int first, int count);
+
+  /**
+   * Start logging in the journal region: the log is restarted after the
+   * transactions already in it and the cache begins holding written blocks.
+   */
+  void start(int first, int count);
+
+  /**
+   * Commit what is held, write everything home and empty the log, then stop
+   * holding written blocks.
+   */
+  void stop();
+
+  bool running() { return active; }
+
+  /**
+   * Record that one more operation has been added to the transaction, and
+   * return whether the transaction should now be committed.
+   */
+  bool add_operation();
+
+  /**
+   * Most blocks one transaction should gather before it is committed.
+   */
+  int batch_limit() { return max_batch / 2; }
+
+  /**
+   * Write the held blocks as one transaction and release them to the cache.
+   */
+  void commit();
+
+  /**
+   * Have commit call hook with true before it writes a transaction too large
+   * for the log home in place, and with false once all of it is there.
+   */
+  void set_overflow_hook(function<void(bool)> hook) { overflow_hook = hook; }
+
+  /**
+   * blocknum is about to hold file data. If an old copy of it is in the
+   * log, write the log home and restart it, so that the copy is never
+   * replayed over the data.
+   */
+  void revoke(int blocknum);
+
+  /**
+   * Print the commit counters.
+   */
+  void report();
+
+ private:
+  struct header {
+    unsigned int magic;
+    unsigned int sequence;
+  };
+
+  struct descriptor {
+    unsigned int magic;
+    unsigned int sequence;
+    int count;
+    int blocks[Disk::DISK_BLOCK_SIZE / sizeof(int) - 3];
+  };
+
+  struct commit_record {
+    unsigned int magic;
+    unsigned int sequence;
+    int count;
+    unsigned int checksum;
+  };
+
+  Disk *disk;
+  Block_Cache *cache;
+  mutex m;
+  bool active;
+
+  int first;
+  int count;
+  // Next block of the log to write and sequence number of the next
+  // transaction.
+  int head;
+  unsigned int sequence;
+  // Most blocks that fit in one transaction.
+  int max_batch;
+  // Home blocks with a copy somewhere in the log.
+  unordered_set<int> logged;
+  function<void(bool)> overflow_hook;
+
+  int operations;
+  int ncommits;
+  int ncommitted_operations;
+  int ncommitted_blocks;
+  int ncheckpoints;
+  int noverflows;
+
+  /**
+   * Walk the transactions of the log, writing them home if apply is set.
+   * Return the sequence number after the last complete one and store the
+   * number found in *found.
+   */
+  unsigned int scan(bool apply, int *found);
+
+  /**
+   * commit() with the journal lock held.
+   */
+  void commit_held();
+
+  /**
+   * Write every committed block home and restart the log.
+   */
+  void checkpoint();
+
+  void write_header();
+
+  static unsigned int checksum(unsigned int sequence, const int *blocks,
+                               int n, const char *const *data);
+};
+
+#endif
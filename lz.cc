@@ -0,0 +1,150 @@
+#include "lz.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/**
+ * Bounded output of compress: every put fails once capacity is reached.
+ */
+class Output {
+ public:
+  Output(char *out, int capacity)
+      : p((uint8_t *)out), end((uint8_t *)out + capacity), start(p) {}
+
+  bool put(uint8_t b) {
+    if (p == end) return false;
+    *p++ = b;
+    return true;
+  }
+
+  bool put(const uint8_t *data, int n) {
+    if (end - p < n) return false;
+    memcpy(p, data, n);
+    p += n;
+    return true;
+  }
+
+  // The bytes past the 15 of a token nibble
+  bool put_length(int n) {
+    for (; n >= 255; n -= 255)
+      if (!put(255)) return false;
+    return put(n);
+  }
+
+  int size() { return p - start; }
+
+ private:
+  uint8_t *p, *end, *start;
+};
+
+/**
+ * Write the literals from..to followed by a match of length bytes offset
+ * back, or by nothing if length is 0.
+ */
+bool put_sequence(Output *out, const uint8_t *from, const uint8_t *to,
+                  int offset, int length) {
+  int literals = to - from;
+  int match = length ? length - LZ_Codec::MIN_MATCH : 0;
+  uint8_t token =
+      (literals < 15 ? literals : 15) << 4 | (match < 15 ? match : 15);
+  if (!out->put(token)) return false;
+  if (literals >= 15 && !out->put_length(literals - 15)) return false;
+  if (!out->put(from, literals)) return false;
+  if (!length) return true;
+
+  if (!out->put(offset & 0xff) || !out->put(offset >> 8)) return false;
+  return match < 15 || out->put_length(match - 15);
+}
+
+}  // namespace
+
+int LZ_Codec::compress(const char *in, int length, char *out, int capacity) {
+  const uint8_t *src = (const uint8_t *)in;
+  Output output(out, capacity);
+
+  int table[1 << HASH_BITS];
+  memset(table, -1, sizeof(table));
+
+  int anchor = 0;
+  for (int i = 0; i + MIN_MATCH <= length;) {
+    uint32_t sequence = read32(src + i);
+    int &slot = table[(sequence * 2654435761u) >> (32 - HASH_BITS)];
+    int candidate = slot;
+    slot = i;
+
+    if (candidate < 0 || i - candidate > MAX_OFFSET ||
+        read32(src + candidate) != sequence) {
+      // Stretches without matches, as in data that does not compress, are
+      // skipped through faster the longer they get
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+
+    int match = MIN_MATCH;
+    while (i + match < length && src[candidate + match] == src[i + match])
+      match++;
+    if (!put_sequence(&output, src + anchor, src + i, i - candidate, match))
+      return 0;
+    i += match;
+    anchor = i;
+  }
+
+  if (!put_sequence(&output, src + anchor, src + length, 0, 0)) return 0;
+  return output.size();
+}
+
+int LZ_Codec::decompress(const char *in, int length, char *out,
+                         int capacity) {
+  const uint8_t *p = (const uint8_t *)in, *end = p + length;
+  uint8_t *dst = (uint8_t *)out;
+  int produced = 0;
+
+  auto get_length = [&](int n) {
+    uint8_t b;
+    do {
+      if (p == end) return -1;
+      b = *p++;
+      n += b;
+      if (n > capacity) return -1;  // too long anyway
+    } while (b == 255);
+    return n;
+  };
+
+  while (p < end) {
+    uint8_t token = *p++;
+    int literals = token >> 4;
+    if (literals == 15 && (literals = get_length(literals)) < 0) return -1;
+    if (literals > end - p || literals > capacity - produced) return -1;
+    memcpy(dst + produced, p, literals);
+    p += literals;
+    produced += literals;
+    if (p == end) break;
+
+    if (end - p < 2) return -1;
+    int offset = p[0] | p[1] << 8;
+    p += 2;
+    int match = token & 15;
+    if (match == 15 && (match = get_length(match)) < 0) return -1;
+    match += MIN_MATCH;
+    if (!offset || offset > produced || match > capacity - produced)
+      return -1;
+
+    // The match may overlap the bytes it produces, as in a run
+    const uint8_t *from = dst + produced - offset;
+    if (offset >= match) {
+      memcpy(dst + produced, from, match);
+    } else {
+      for (int k = 0; k < match; ++k) dst[produced + k] = from[k];
+    }
+    produced += match;
+  }
+  return produced;
+}
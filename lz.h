@@ -0,0 +1,38 @@
+#ifndef LZ_H
+#define LZ_H
+
+/**
+ * A small LZ77 codec in the style of LZ4, for compressing file data with no
+ * library. The output is a series of sequences, each a token byte (literal
+ * count in the high nibble, match length minus MIN_MATCH in the low one,
+ * 15 meaning that more bytes of 255 and a last smaller one follow), the
+ * literals, and a 2-byte little-endian offset back to the match. The last
+ * sequence only has literals.
+ *
+ * Matches are found through a hash table of the last position each 4-byte
+ * sequence was seen at, so compression is a single fast pass; runs of one
+ * byte, zeros above all, shrink to a few bytes.
+ */
+class LZ_Codec {
+ public:
+  static const int MIN_MATCH = 4;
+  static const int MAX_OFFSET = 65535;
+
+  /**
+   * Compress the length bytes of in into out. Returns the size of the
+   * result, or 0 if it does not fit in capacity bytes.
+   */
+  static int compress(const char *in, int length, char *out, int capacity);
+
+  /**
+   * Decompress the length bytes of in into out. Returns the number of bytes
+   * produced, or -1 if in is not valid or its data does not fit in capacity
+   * bytes.
+   */
+  static int decompress(const char *in, int length, char *out, int capacity);
+
+ private:
+  static const int HASH_BITS = 13;
+};
+
+#endif
@@ -0,0 +1,33 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+
+namespace Protocol {
+
+bool send_all(int fd, const void *data, size_t length) {
+  const char *p = (const char *)data;
+  while (length) {
+    // A peer that went away must not kill the process with SIGPIPE
+    ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+bool recv_all(int fd, void *data, size_t length) {
+  char *p = (char *)data;
+  while (length) {
+    ssize_t n = recv(fd, p, length, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+}  // namespace Protocol
@@ -0,0 +1,74 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Binary protocol spoken over the Unix socket of FS_Server. A client sends
+ * requests, each a request_header followed, for a write, by length bytes of
+ * data. The server answers every request with a reply_header followed, for
+ * a read or a stat, by length bytes of data. A client may send many
+ * requests without waiting for the replies; these come back as each request
+ * finishes, not necessarily in order, and carry the id of their request.
+ *
+ * Both ends run on the same machine, so fields are in host byte order.
+ */
+namespace Protocol {
+
+const uint32_t MAGIC = 0x53465331;
+
+// Largest read or write a single request may ask for.
+const int32_t MAX_TRANSFER = 1 << 20;
+
+enum op : uint16_t {
+  OP_CREATE = 1,
+  OP_DELETE = 2,
+  OP_READ = 3,
+  OP_WRITE = 4,
+  OP_GETSIZE = 5,
+  OP_STAT = 6,
+};
+
+struct request_header {
+  uint32_t magic;
+  // Chosen by the client and sent back in the reply.
+  uint32_t id;
+  uint16_t op;
+  uint16_t unused;
+  int32_t inumber;
+  int32_t offset;
+  // Bytes to read, or bytes of data following a write.
+  int32_t length;
+};
+
+struct reply_header {
+  uint32_t magic;
+  uint32_t id;
+  // What the file system call returned, or ERROR if the request was not
+  // understood.
+  int32_t result;
+  // Bytes of data following the reply.
+  int32_t length;
+};
+
+// Data of the reply to OP_STAT.
+struct stat_reply {
+  int32_t size;
+  int32_t blocks;
+  int32_t flags;
+};
+
+const int32_t ERROR = -1;
+
+/**
+ * Send or receive exactly length bytes on socket fd, retrying after short
+ * transfers and interrupted calls. Return false if the connection was
+ * closed or failed first.
+ */
+bool send_all(int fd, const void *data, size_t length);
+bool recv_all(int fd, void *data, size_t length);
+
+}  // namespace Protocol
+
+#endif
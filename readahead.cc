@@ -0,0 +1,105 @@
+#include "readahead.h"
+
+#include <algorithm>
+#include <cstring>
+
+Read_Ahead::Read_Ahead(Disk *d) {
+  disk = d;
+  nprefetched = 0;
+  nhits = 0;
+  nwasted = 0;
+
+  disk->add_close_hook([this]() {
+    clear();
+    report();
+  });
+}
+
+void Read_Ahead::access(int inumber, int first, int last, int nblocks,
+                        int *from, int *to) {
+  lock_guard<mutex> lock(m);
+  auto it = streams.find(inumber);
+  if (it == streams.end()) {
+    // Treat a first read from the start of the file as the start of a scan.
+    it = streams.insert({inumber, {-1, 0, 0}}).first;
+  }
+  stream &s = it->second;
+
+  // A read that starts in the block where the previous one ended, or in the
+  // one right after it, continues the scan.
+  if (first == s.last || first == s.last + 1) {
+    s.window = s.window ? min(s.window * 2, (int)MAX_WINDOW) : MIN_WINDOW;
+  } else {
+    s.window = 0;
+    s.end = 0;
+  }
+  s.last = last;
+
+  *from = max(last + 1, s.end);
+  *to = min(last + 1 + s.window, nblocks);
+  if (*to < *from) *to = *from;
+  s.end = max(s.end, *to);
+}
+
+void Read_Ahead::prefetch(int blocknum) {
+  lock_guard<mutex> lock(m);
+  if (!blocknum || index.count(blocknum)) return;
+
+  if ((int)entries.size() >= CAPACITY) drop(entries.begin());
+
+  entries.emplace_back();
+  entry &e = entries.back();
+  e.blocknum = blocknum;
+  e.ready = false;
+  e.used = false;
+  index[blocknum] = prev(entries.end());
+
+  nprefetched++;
+  disk->submit_read(blocknum, e.data, [&e]() { e.ready = true; });
+}
+
+bool Read_Ahead::copy(int blocknum, int offset, int length, char *dest) {
+  lock_guard<mutex> lock(m);
+  auto it = index.find(blocknum);
+  if (it == index.end()) return false;
+
+  entry &e = *it->second;
+  while (!e.ready) disk->poll(true);
+
+  if (!e.used) nhits++;
+  e.used = true;
+  memcpy(dest, e.data + offset, length);
+  return true;
+}
+
+void Read_Ahead::invalidate(int blocknum) {
+  lock_guard<mutex> lock(m);
+  auto it = index.find(blocknum);
+  if (it != index.end()) drop(it->second);
+}
+
+void Read_Ahead::forget(int inumber) {
+  lock_guard<mutex> lock(m);
+  streams.erase(inumber);
+}
+
+void Read_Ahead::clear() {
+  lock_guard<mutex> lock(m);
+  while (!entries.empty()) drop(entries.begin());
+  streams.clear();
+}
+
+void Read_Ahead::drop(list<entry>::iterator e) {
+  // The disk still writes into the entry until the read finishes.
+  while (!e->ready) disk->poll(true);
+
+  if (!e->used) nwasted++;
+  index.erase(e->blocknum);
+  entries.erase(e);
+}
+
+void Read_Ahead::report() {
+  cout << nprefetched << " read-ahead blocks\n";
+  cout << nhits << " read-ahead hits\n";
+  cout << nwasted << " read-ahead blocks wasted\n";
+}
@@ -0,0 +1,98 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "disk.h"
+
+/**
+ * Sequential read-ahead for file data. Each inode read through fs_read has
+ * a window that doubles, up to MAX_WINDOW blocks, while the file is read
+ * front to back and drops to zero on a random access. The blocks in the
+ * window past the end of the current read are fetched with asynchronous
+ * disk requests into a small buffer, so that they are already in memory (or
+ * on their way) when the next fs_read asks for them. Every call takes the
+ * read-ahead lock, so fs_read may run in several threads at once.
+ */
+class Read_Ahead {
+ public:
+  static const int CAPACITY = 256;
+  static const int MIN_WINDOW = 4;
+  static const int MAX_WINDOW = 64;
+
+  Read_Ahead(Disk *d);
+
+  /**
+   * Record that fs_read is about to read data blocks first to last of
+   * inumber, which has nblocks blocks in total. Store in *from and *to the
+   * range [from, to) of block indexes that should be prefetched.
+   */
+  void access(int inumber, int first, int last, int nblocks, int *from,
+              int *to);
+
+  /**
+   * Start reading blocknum in the background, unless it is already buffered.
+   */
+  void prefetch(int blocknum);
+
+  /**
+   * Copy length bytes at offset of the prefetched contents of blocknum to
+   * dest, waiting for the disk if the read is still in flight. Returns false
+   * if blocknum was not prefetched.
+   */
+  bool copy(int blocknum, int offset, int length, char *dest);
+
+  /**
+   * Drop the buffered copy of blocknum, which is about to be overwritten.
+   */
+  void invalidate(int blocknum);
+
+  /**
+   * Forget the access pattern of inumber.
+   */
+  void forget(int inumber);
+
+  /**
+   * Drop every buffered block and access pattern.
+   */
+  void clear();
+
+  /**
+   * Print the read-ahead counters.
+   */
+  void report();
+
+ private:
+  struct stream {
+    int last;
+    int window;
+    // Blocks before this index have already been prefetched.
+    int end;
+  };
+
+  struct entry {
+    int blocknum;
+    atomic<bool> ready;
+    bool used;
+    char data[Disk::DISK_BLOCK_SIZE];
+  };
+
+  Disk *disk;
+  mutex m;
+  unordered_map<int, stream> streams;
+
+  // Oldest prefetch at the front.
+  list<entry> entries;
+  unordered_map<int, list<entry>::iterator> index;
+
+  int nprefetched;
+  int nhits;
+  int nwasted;
+
+  void drop(list<entry>::iterator e);
+};
+
+#endif
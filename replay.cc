@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "disk.h"
+#include "fs.h"
+#include "trace.h"
+
+using namespace std;
+
+/**
+ * Runs a trace recorded with the shell's trace command against a fresh
+ * image, as fast as possible or (with -t) keeping the delays between calls,
+ * and reports the throughput, the disk blocks transferred and the
+ * per-operation statistics of the run.
+ *
+ * Inode numbers in the trace are mapped to the ones the replay gets from
+ * fs_create. An inode the trace uses without creating it existed before
+ * recording started; it is created on first use, and calls whose result
+ * differs from the recorded one, as reads of its old contents will, are
+ * counted. Writes store a fixed pattern, since the trace has no data.
+ */
+class Trace_Replay {
+ public:
+  Trace_Replay(INE5412_FS *f) : fs(f) {}
+
+  /**
+   * Run the records of the trace file at path. Returns false if the file is
+   * not a trace.
+   */
+  bool run(const char *path, bool timed);
+
+  long ncalls = 0;
+  long nbytes = 0;
+  long ndiffering = 0;
+  long npreexisting = 0;
+
+ private:
+  INE5412_FS *fs;
+  // Inode numbers of the trace to those of the replay
+  map<int, int> inodes;
+  vector<char> buffer;
+
+  int inode(int traced);
+  int replay(const Trace_Recorder::record &r, FILE *file);
+};
+
+int main(int argc, char *argv[]) {
+  int cache_blocks = Block_Cache::DEFAULT_CAPACITY;
+  bool mapped = false;
+  bool extents = true;
+  bool timed = false;
+  bool usage = argc < 4;
+
+  for (int i = 4; i < argc && !usage; i++) {
+    if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      cache_blocks = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-m")) {
+      mapped = true;
+    } else if (!strcmp(argv[i], "-p")) {
+      extents = false;
+    } else if (!strcmp(argv[i], "-t")) {
+      timed = true;
+    } else {
+      usage = true;
+    }
+  }
+
+  if (usage) {
+    printf("use: %s <trace> <diskfile> <nblocks> [-c <cacheblocks>] [-m] [-p]"
+           " [-t]\n",
+           argv[0]);
+    return 1;
+  }
+
+  // The messages of the file system would drown the report
+  cout.setstate(ios::failbit);
+  unlink(argv[2]);
+  Disk disk(argv[2], atoi(argv[3]), mapped);
+  INE5412_FS fs(&disk, cache_blocks, extents);
+
+  Trace_Replay replay(&fs);
+  int reads = disk.reads(), writes = disk.writes();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  if (!replay.run(argv[1], timed)) {
+    printf("%s is not a trace\n", argv[1]);
+    return 1;
+  }
+  fs.fs_umount();
+  double elapsed =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  reads = disk.reads() - reads;
+  writes = disk.writes() - writes;
+
+  printf("replayed %ld calls in %.3f s: %.0f calls/s, %.1f MB/s\n",
+         replay.ncalls, elapsed, replay.ncalls / elapsed,
+         replay.nbytes / elapsed / (1 << 20));
+  printf("%d disk block reads, %d disk block writes (%.2f and %.2f per call)\n",
+         reads, writes, replay.ncalls ? (double)reads / replay.ncalls : 0,
+         replay.ncalls ? (double)writes / replay.ncalls : 0);
+  printf("%ld calls returned a different result than recorded\n",
+         replay.ndiffering);
+  printf("%ld inodes in use before the trace were created on first use\n\n",
+         replay.npreexisting);
+  fflush(stdout);
+
+  cout.clear();
+  disk.stats()->print(cout);
+  cout.setstate(ios::failbit);
+  disk.close();
+  return 0;
+}
+
+bool Trace_Replay::run(const char *path, bool timed) {
+  FILE *file = fopen(path, "rb");
+  if (!file) return false;
+
+  Trace_Recorder::header h;
+  if (fread(&h, sizeof(h), 1, file) != 1 ||
+      h.magic != Trace_Recorder::MAGIC ||
+      h.version != Trace_Recorder::VERSION) {
+    fclose(file);
+    return false;
+  }
+
+  // A trace recorded on a mounted disk starts with it mounted
+  Trace_Recorder::record r;
+  bool more = fread(&r, sizeof(r), 1, file) == 1;
+  fs->fs_format();
+  if (!more ||
+      (r.op != Trace_Recorder::FORMAT && r.op != Trace_Recorder::MOUNT))
+    fs->fs_mount();
+
+  chrono::steady_clock::time_point due = chrono::steady_clock::now();
+  for (; more; more = fread(&r, sizeof(r), 1, file) == 1) {
+    if (timed) {
+      due += chrono::microseconds(r.delay);
+      this_thread::sleep_until(due);
+    }
+
+    int result = replay(r, file);
+    ncalls++;
+    if (r.op == Trace_Recorder::CREATE ? (result > 0) != (r.result > 0)
+                                       : result != r.result)
+      ndiffering++;
+  }
+
+  fclose(file);
+  return true;
+}
+
+int Trace_Replay::inode(int traced) {
+  auto it = inodes.find(traced);
+  if (it != inodes.end()) return it->second;
+
+  int inumber = fs->fs_create();
+  if (inumber > 0) {
+    inodes[traced] = inumber;
+    npreexisting++;
+  }
+  return inumber;
+}
+
+int Trace_Replay::replay(const Trace_Recorder::record &r, FILE *file) {
+  if (r.op == Trace_Recorder::READ || r.op == Trace_Recorder::WRITE) {
+    if (r.length < 0) return 0;
+    if ((int)buffer.size() < r.length) buffer.resize(r.length, 't');
+    nbytes += r.length;
+  }
+
+  switch (r.op) {
+    case Trace_Recorder::FORMAT:
+      return fs->fs_format();
+    case Trace_Recorder::MOUNT:
+      return fs->fs_mount();
+    case Trace_Recorder::UMOUNT:
+      return fs->fs_umount();
+    case Trace_Recorder::SYNC:
+      return fs->fs_sync();
+    case Trace_Recorder::CREATE: {
+      int inumber = fs->fs_create();
+      if (inumber > 0 && r.result > 0) inodes[r.result] = inumber;
+      return inumber;
+    }
+    case Trace_Recorder::CREATE_MANY: {
+      vector<int> created(max(r.length, 0));
+      int n = fs->fs_create_many(created.size(), created.data());
+
+      // The inodes the recording got follow the call
+      Trace_Recorder::record i;
+      for (int k = 0; k < r.result; ++k) {
+        if (fread(&i, sizeof(i), 1, file) != 1 ||
+            i.op != Trace_Recorder::INODE)
+          break;
+        if (k < n) inodes[i.inumber] = created[k];
+      }
+      return n;
+    }
+    case Trace_Recorder::DELETE: {
+      int result = fs->fs_delete(inode(r.inumber));
+      inodes.erase(r.inumber);
+      return result;
+    }
+    case Trace_Recorder::GETSIZE:
+      return fs->fs_getsize(inode(r.inumber));
+    case Trace_Recorder::STAT: {
+      INE5412_FS::fs_stat_info info;
+      return fs->fs_stat(inode(r.inumber), &info);
+    }
+    case Trace_Recorder::READ:
+      return fs->fs_read(inode(r.inumber), buffer.data(), r.length, r.offset);
+    case Trace_Recorder::WRITE:
+      return fs->fs_write(inode(r.inumber), buffer.data(), r.length, r.offset);
+    case Trace_Recorder::FALLOCATE:
+      return fs->fs_fallocate(inode(r.inumber), r.length);
+    case Trace_Recorder::TRUNCATE:
+      return fs->fs_truncate(inode(r.inumber), r.length);
+    case Trace_Recorder::COMPRESS:
+      return fs->fs_compress(inode(r.inumber));
+  }
+  return 0;
+}
@@ -0,0 +1,258 @@
+#include "server.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace Protocol;
+
+FS_Server::FS_Server(INE5412_FS *f, int n) {
+  fs = f;
+  nworkers = n;
+  wake[0] = wake[1] = -1;
+  stopping = false;
+  nconnections = 0;
+  nrequests = 0;
+}
+
+FS_Server::~FS_Server() {
+  if (wake[0] >= 0) close(wake[0]);
+  if (wake[1] >= 0) close(wake[1]);
+}
+
+FS_Server::connection::~connection() { close(fd); }
+
+bool FS_Server::serve(const char *path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    cout << "Error: socket path " << path << " is too long\n";
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (wake[0] < 0 && pipe(wake) < 0) {
+    cout << "Error: " << strerror(errno) << "\n";
+    return false;
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    cout << "Error: couldn't listen on " << path << ": " << strerror(errno)
+         << "\n";
+    if (listener >= 0) close(listener);
+    return false;
+  }
+
+  stopping = false;
+  for (int i = 0; i < nworkers; ++i) workers.emplace_back([this]() { work(); });
+
+  while (true) {
+    pollfd fds[2] = {{listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[1].revents) {
+      char c;
+      while (read(wake[0], &c, 1) < 0 && errno == EINTR) {
+      }
+      break;
+    }
+    if (!fds[0].revents) continue;
+
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) continue;
+
+    reap_readers();
+    auto conn = make_shared<connection>();
+    conn->fd = fd;
+    lock_guard<mutex> lock(m);
+    nconnections++;
+    readers.emplace_back();
+    reader *r = &readers.back();
+    r->conn = conn;
+    r->t = thread([this, conn, r]() { read_requests(conn, r); });
+  }
+
+  close(listener);
+  unlink(path);
+
+  // Stop reading new requests, then let the workers answer the ones
+  // already read before they exit
+  {
+    lock_guard<mutex> lock(m);
+    for (reader &r : readers)
+      if (auto conn = r.conn.lock()) shutdown(conn->fd, SHUT_RD);
+  }
+  for (reader &r : readers) r.t.join();
+  readers.clear();
+
+  {
+    lock_guard<mutex> lock(m);
+    stopping = true;
+  }
+  queued.notify_all();
+  for (thread &t : workers) t.join();
+  workers.clear();
+  return true;
+}
+
+void FS_Server::stop() {
+  char c = 0;
+  // Only write() is made here, so this may run in a signal handler
+  if (write(wake[1], &c, 1) < 0) {
+  }
+}
+
+void FS_Server::reap_readers() {
+  lock_guard<mutex> lock(m);
+  for (auto it = readers.begin(); it != readers.end();) {
+    if (it->finished) {
+      it->t.join();
+      it = readers.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void FS_Server::read_requests(shared_ptr<connection> conn, reader *self) {
+  while (true) {
+    job j;
+    j.conn = conn;
+    request_header &req = j.request;
+    if (!recv_all(conn->fd, &req, sizeof(req)) || req.magic != MAGIC) break;
+
+    // The data of a write that is too large cannot be skipped safely, so
+    // the connection is dropped
+    if (req.op == OP_WRITE) {
+      if (req.length < 0 || req.length > MAX_TRANSFER) break;
+      j.data.resize(req.length);
+      if (!recv_all(conn->fd, j.data.data(), req.length)) break;
+    }
+
+    {
+      unique_lock<mutex> lock(conn->m);
+      conn->answered.wait(lock,
+                          [&conn]() { return conn->in_flight < MAX_IN_FLIGHT; });
+      conn->in_flight++;
+    }
+    dispatch(move(j));
+  }
+
+  lock_guard<mutex> lock(m);
+  self->finished = true;
+}
+
+void FS_Server::dispatch(job j) {
+  if (j.request.op != OP_CREATE) {
+    connection *conn = j.conn.get();
+    lock_guard<mutex> lock(conn->m);
+    auto it = conn->waiting.find(j.request.inumber);
+    if (it != conn->waiting.end()) {
+      it->second.push_back(move(j));
+      return;
+    }
+    conn->waiting[j.request.inumber];
+  }
+  enqueue(move(j));
+}
+
+void FS_Server::enqueue(job j) {
+  {
+    lock_guard<mutex> lock(m);
+    jobs.push_back(move(j));
+  }
+  queued.notify_one();
+}
+
+void FS_Server::work() {
+  while (true) {
+    job j;
+    {
+      unique_lock<mutex> lock(m);
+      queued.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      if (jobs.empty()) return;
+      j = move(jobs.front());
+      jobs.pop_front();
+      nrequests++;
+    }
+
+    execute(j);
+
+    // Start the next request of this connection on the same inode, if one
+    // is waiting
+    connection *conn = j.conn.get();
+    optional<job> next;
+    {
+      lock_guard<mutex> lock(conn->m);
+      if (j.request.op != OP_CREATE) {
+        auto it = conn->waiting.find(j.request.inumber);
+        if (it->second.empty()) {
+          conn->waiting.erase(it);
+        } else {
+          next = move(it->second.front());
+          it->second.pop_front();
+        }
+      }
+      conn->in_flight--;
+    }
+    conn->answered.notify_one();
+    if (next) enqueue(move(*next));
+  }
+}
+
+void FS_Server::execute(job &j) {
+  const request_header &req = j.request;
+  reply_header reply = {MAGIC, req.id, ERROR, 0};
+  vector<char> out;
+
+  switch (req.op) {
+    case OP_CREATE:
+      reply.result = fs->fs_create();
+      break;
+    case OP_DELETE:
+      reply.result = fs->fs_delete(req.inumber);
+      break;
+    case OP_READ:
+      if (req.length < 0 || req.length > MAX_TRANSFER) break;
+      out.resize(req.length);
+      reply.result = fs->fs_read(req.inumber, out.data(), req.length, req.offset);
+      reply.length = max(reply.result, 0);
+      break;
+    case OP_WRITE:
+      reply.result =
+          fs->fs_write(req.inumber, j.data.data(), req.length, req.offset);
+      break;
+    case OP_GETSIZE:
+      reply.result = fs->fs_getsize(req.inumber);
+      break;
+    case OP_STAT: {
+      INE5412_FS::fs_stat_info info;
+      reply.result = fs->fs_stat(req.inumber, &info);
+      if (reply.result) {
+        stat_reply s = {info.size, info.blocks, info.flags};
+        out.assign((char *)&s, (char *)&s + sizeof(s));
+        reply.length = sizeof(s);
+      }
+      break;
+    }
+  }
+
+  // A client that went away just misses its reply
+  lock_guard<mutex> lock(j.conn->send_lock);
+  if (send_all(j.conn->fd, &reply, sizeof(reply)) && reply.length)
+    send_all(j.conn->fd, out.data(), reply.length);
+}
+
+void FS_Server::report() {
+  cout << nrequests << " requests served\n";
+  cout << nconnections << " connections\n";
+}
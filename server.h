@@ -0,0 +1,117 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fs.h"
+#include "protocol.h"
+
+/**
+ * Serves a mounted file system to other processes over a Unix domain socket,
+ * speaking the protocol of protocol.h. Each connection has a thread that
+ * reads its requests and queues them for a pool of worker threads, which
+ * make the file system calls and send the replies; a client can therefore
+ * keep many requests in flight at once.
+ *
+ * The requests of one connection on the same inode run in the order they
+ * were sent, so that a stream of appends can be pipelined; requests on
+ * different inodes, or from different connections, run in parallel. Each
+ * connection has at most MAX_IN_FLIGHT requests queued or running; reading
+ * from it waits while it has that many.
+ */
+class FS_Server {
+ public:
+  static const int DEFAULT_WORKERS = 4;
+  static const int MAX_IN_FLIGHT = 64;
+
+  FS_Server(INE5412_FS *f, int nworkers = DEFAULT_WORKERS);
+  ~FS_Server();
+
+  /**
+   * Listen on the socket at path, replacing any file there, and serve
+   * clients until stop() is called. Every request received has been
+   * answered when this returns. Returns false if the socket could not be
+   * set up.
+   */
+  bool serve(const char *path);
+
+  /**
+   * Make serve() return. Safe to call from a signal handler.
+   */
+  void stop();
+
+  /**
+   * Print the server counters.
+   */
+  void report();
+
+ private:
+  struct connection;
+
+  struct job {
+    shared_ptr<connection> conn;
+    Protocol::request_header request;
+    vector<char> data;
+  };
+
+  struct connection {
+    int fd;
+    // Held while a reply is sent, so that replies are not interleaved.
+    mutex send_lock;
+
+    mutex m;
+    condition_variable answered;
+    int in_flight = 0;
+    // An inode is a key here while a request of this connection on it is
+    // queued or running; later requests on it wait in its list.
+    map<int, deque<job>> waiting;
+
+    ~connection();
+  };
+
+  struct reader {
+    weak_ptr<connection> conn;
+    thread t;
+    bool finished = false;
+  };
+
+  INE5412_FS *fs;
+  int nworkers;
+  int wake[2];
+
+  mutex m;
+  condition_variable queued;
+  deque<job> jobs;
+  bool stopping;
+  vector<thread> workers;
+  list<reader> readers;
+
+  int nconnections;
+  long nrequests;
+
+  void read_requests(shared_ptr<connection> conn, reader *self);
+
+  /**
+   * Queue j, or park it behind an earlier request of its connection on the
+   * same inode.
+   */
+  void dispatch(job j);
+  void enqueue(job j);
+
+  void work();
+  void execute(job &j);
+
+  /**
+   * Join the reader threads of connections that have been closed.
+   */
+  void reap_readers();
+};
+
+#endif
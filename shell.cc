@@ -1,9 +1,25 @@
 #include "fs.h"
 #include "disk.h"
+#include "server.h"
 
+#include <climits>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * copyin and copyout move data through COPY_BUFFERS buffers of
+ * COPY_BUFFER_SIZE bytes, filled and drained with one vectored call each
+ * time on both sides.
+ */
+static const int COPY_BUFFERS = 8;
+static const size_t COPY_BUFFER_SIZE = 65536;
 
 class File_Ops
 {
@@ -16,6 +32,13 @@ public:
 
 using namespace std;
 
+static FS_Server *serving;
+
+static void stop_serving(int)
+{
+	serving->stop();
+}
+
 int main( int argc, char *argv[] )
 {
 	char line[1024];
@@ -23,16 +46,37 @@ int main( int argc, char *argv[] )
 	char arg1[1024];
 	char arg2[1024];
 	int inumber, result, args;
+	int cache_blocks = Block_Cache::DEFAULT_CAPACITY;
+	bool mapped = false;
+	bool extents = true;
+	const char *stats_file = nullptr;
+	bool usage = argc < 3;
+
+	for(int i = 3; i < argc && !usage; i++) {
+		if(!strcmp(argv[i], "-c") && i + 1 < argc) {
+			cache_blocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-m")) {
+			mapped = true;
+		} else if(!strcmp(argv[i], "-p")) {
+			extents = false;
+		} else if(!strcmp(argv[i], "-s") && i + 1 < argc) {
+			stats_file = argv[++i];
+		} else {
+			usage = true;
+		}
+	}
 
-	if(argc != 3) {
-		cout << "use: " << argv[0] << " <diskfile> <nblocks>\n";
+	if(usage) {
+		cout << "use: " << argv[0] << " <diskfile> <nblocks> [-c <cacheblocks>] [-m] [-p] [-s <statsfile>]\n";
 		return 1;
 	}
 
 
-    Disk disk(argv[1], atoi(argv[2]));
+    Disk disk(argv[1], atoi(argv[2]), mapped);
+    if(stats_file)
+        disk.stats()->set_dump_file(stats_file);
 
-    INE5412_FS fs(&disk);
+    INE5412_FS fs(&disk, cache_blocks, extents);
 
 	cout << "opened emulated disk image " << argv[1] << " with " << disk.size() << " blocks\n";
 
@@ -83,6 +127,16 @@ int main( int argc, char *argv[] )
 			} else {
 				cout << "use: umount\n";
 			}
+		} else if (!strcmp(cmd, "sync")){
+			if (args == 1) {
+				if (fs.fs_sync()) {
+					cout << "disk synced.\n";
+				} else {
+					cout << "sync failed!\n";
+				}
+			} else {
+				cout << "use: sync\n";
+			}
 		} else if(!strcmp(cmd, "debug")) {
 			if(args == 1) {
 				fs.fs_debug();
@@ -102,6 +156,39 @@ int main( int argc, char *argv[] )
 				cout << "use: getsize <inumber>\n";
 			}
 			
+		} else if(!strcmp(cmd, "fallocate")) {
+			if(args == 3) {
+				inumber = atoi(arg1);
+				if(fs.fs_fallocate(inumber, atoi(arg2))) {
+					cout << "reserved " << arg2 << " bytes for inode " << inumber << "\n";
+				} else {
+					cout << "fallocate failed!\n";
+				}
+			} else {
+				cout << "use: fallocate <inumber> <length>\n";
+			}
+		} else if(!strcmp(cmd, "truncate")) {
+			if(args == 3) {
+				inumber = atoi(arg1);
+				if(fs.fs_truncate(inumber, atoi(arg2))) {
+					cout << "inode " << inumber << " truncated to " << arg2 << " bytes\n";
+				} else {
+					cout << "truncate failed!\n";
+				}
+			} else {
+				cout << "use: truncate <inumber> <length>\n";
+			}
+		} else if(!strcmp(cmd, "compress")) {
+			if(args == 2) {
+				inumber = atoi(arg1);
+				if(fs.fs_compress(inumber)) {
+					cout << "inode " << inumber << " compressed\n";
+				} else {
+					cout << "compress failed!\n";
+				}
+			} else {
+				cout << "use: compress <inumber>\n";
+			}
 		} else if(!strcmp(cmd, "create")) {
 			if(args == 1) {
 				inumber = fs.fs_create();
@@ -113,6 +200,19 @@ int main( int argc, char *argv[] )
 			} else {
 				cout << "use: create\n";
 			}
+		} else if(!strcmp(cmd, "createmany")) {
+			if(args == 2 && atoi(arg1) > 0) {
+				int count = atoi(arg1);
+				vector<int> inumbers(count);
+				result = fs.fs_create_many(count, inumbers.data());
+				if(result > 0) {
+					cout << "created " << result << " inodes, " << inumbers[0] << " to " << inumbers[result - 1] << "\n";
+				} else {
+					cout << "createmany failed!\n";
+				}
+			} else {
+				cout << "use: createmany <count>\n";
+			}
 		} else if(!strcmp(cmd, "delete")) {
 			if(args == 2) {
 				inumber = atoi(arg1);
@@ -158,18 +258,74 @@ int main( int argc, char *argv[] )
 				cout << "use: copyout <inumber> <filename>\n";
 			}
 
+		} else if(!strcmp(cmd, "serve")) {
+			if(args == 2 || (args == 3 && atoi(arg2) > 0)) {
+				FS_Server server(&fs, args == 3 ? atoi(arg2) : FS_Server::DEFAULT_WORKERS);
+
+				// Serve until interrupted, then come back to the prompt
+				struct sigaction stop, oldint, oldterm;
+				memset(&stop, 0, sizeof(stop));
+				stop.sa_handler = stop_serving;
+				serving = &server;
+				sigaction(SIGINT, &stop, &oldint);
+				sigaction(SIGTERM, &stop, &oldterm);
+
+				cout << "serving on " << arg1 << ", interrupt to stop.\n";
+				fflush(stdout);
+				if(server.serve(arg1)) {
+					cout << "server stopped.\n";
+					server.report();
+				} else {
+					cout << "serve failed!\n";
+				}
+
+				sigaction(SIGINT, &oldint, nullptr);
+				sigaction(SIGTERM, &oldterm, nullptr);
+				serving = nullptr;
+			} else {
+				cout << "use: serve <socket> [workers]\n";
+			}
+		} else if(!strcmp(cmd, "stats")) {
+			if(args == 1) {
+				disk.stats()->print(cout);
+			} else if(args == 2 && !strcmp(arg1, "reset")) {
+				disk.stats()->reset();
+				cout << "statistics reset.\n";
+			} else {
+				cout << "use: stats [reset]\n";
+			}
+		} else if(!strcmp(cmd, "trace")) {
+			if(args == 3 && !strcmp(arg1, "start")) {
+				if(fs.recorder()->start(arg2)) {
+					cout << "recording calls to " << arg2 << ".\n";
+				} else {
+					cout << "couldn't create " << arg2 << "\n";
+				}
+			} else if(args == 2 && !strcmp(arg1, "stop")) {
+				cout << fs.recorder()->stop() << " trace records written.\n";
+			} else {
+				cout << "use: trace start <file> | trace stop\n";
+			}
 		} else if(!strcmp(cmd, "help")) {
 			cout << "Commands are:\n";
 			cout << "    format\n";
 			cout << "    mount\n";
 			cout << "    umount\n";
+			cout << "    sync\n";
 			cout << "    getsize <inode>\n";
+			cout << "    fallocate <inode> <length>\n";
+			cout << "    truncate <inode> <length>\n";
+			cout << "    compress <inode>\n";
 			cout << "    debug\n";
 			cout << "    create\n";
+			cout << "    createmany <count>\n";
 			cout << "    delete  <inode>\n";
 			cout << "    cat     <inode>\n";
 			cout << "    copyin  <file> <inode>\n";
 			cout << "    copyout <inode> <file>\n";
+			cout << "    serve   <socket> [workers]\n";
+			cout << "    stats   [reset]\n";
+			cout << "    trace   start <file> | stop\n";
 			cout << "    help\n";
 			cout << "    quit\n";
 			cout << "    exit\n";
@@ -190,64 +346,150 @@ int main( int argc, char *argv[] )
 	return 0;
 }
 
-int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
+/*
+ * Point iov at the first copy buffers, as many as it takes to hold length
+ * bytes, and return how many that is.
+ */
+static int fill_iovecs(struct iovec *iov, char **buffers, size_t length)
 {
-	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	int n = 0;
+	while(length > 0 && n < COPY_BUFFERS) {
+		iov[n].iov_base = buffers[n];
+		iov[n].iov_len = length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE;
+		length -= iov[n].iov_len;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Write all of iov to fd, going on after short writes.
+ */
+static bool writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while(iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			return false;
+		while(iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+/*
+ * Copy a regular file of the given size in with a single fs_write_stream
+ * call, which maps all its blocks up front and reads the next chunk of it
+ * while the previous one is being written.
+ */
+static int copyin_stream(int fd, off_t size, int inumber, INE5412_FS *fs)
+{
+	int length = size < INT_MAX ? size : INT_MAX;
+	int actual = fs->fs_write_stream(inumber, 0, length, [fd](char *data, int n) {
+		int got = 0;
+		while(got < n) {
+			ssize_t result = read(fd, data + got, n - got);
+			if(result < 0 && errno == EINTR)
+				continue;
+			if(result <= 0)
+				break;
+			got += result;
+		}
+		return got;
+	});
+	if(actual != size)
+		cout << "WARNING: fs_write_stream only wrote " << actual << " bytes, not " << size << " bytes\n";
+	return actual;
+}
 
-	file = fopen(filename, "r");
-	if(!file) {
+int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
+{
+	int fd, offset=0, actual;
+	ssize_t result;
+	char *buffers[COPY_BUFFERS];
+	struct iovec iov[COPY_BUFFERS];
+	struct stat info;
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0) {
 		cout << "couldn't open " << filename << "\n";
 		return 0;
 	}
 
+	// The size of a regular file is known up front, so it can be streamed
+	// in; anything else is copied a few buffers at a time.
+	if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+		offset = copyin_stream(fd, info.st_size, inumber, fs);
+		cout << offset << " bytes copied\n";
+		close(fd);
+		return 1;
+	}
+
+	for(int i = 0; i < COPY_BUFFERS; i++)
+		buffers[i] = (char *) malloc(COPY_BUFFER_SIZE);
+
 	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
+		result = readv(fd, iov, fill_iovecs(iov, buffers, COPY_BUFFERS * COPY_BUFFER_SIZE));
 		if(result <= 0) break;
-		if(result > 0) {
-			actual = fs->fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				cout << "ERROR: fs_write return invalid result " << actual << "\n";
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				cout << "WARNING: fs_write only wrote " << actual << " bytes, not " << result << " bytes\n";
-				break;
-			}
+		actual = fs->fs_writev(inumber,iov,fill_iovecs(iov, buffers, result),offset);
+		if(actual<0) {
+			cout << "ERROR: fs_writev return invalid result " << actual << "\n";
+			break;
+		}
+		offset += actual;
+		if(actual!=result) {
+			cout << "WARNING: fs_writev only wrote " << actual << " bytes, not " << result << " bytes\n";
+			break;
 		}
 	}
 
 	cout << offset << " bytes copied\n";
 
-    fclose(file);
+	for(int i = 0; i < COPY_BUFFERS; i++)
+		free(buffers[i]);
+	close(fd);
 
 	return 1;
 }
 
 int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
 {
-	FILE *file;
-	int offset = 0, result;
-	char buffer[16384];
+	int fd, offset = 0, result;
+	char *buffers[COPY_BUFFERS];
+	struct iovec iov[COPY_BUFFERS];
 
-	file = fopen(filename,"w");
-	if(!file) {
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0) {
 		cout << "couldn't open " << filename << "\n";
 		return 0;
 	}
 
+	for(int i = 0; i < COPY_BUFFERS; i++)
+		buffers[i] = (char *) malloc(COPY_BUFFER_SIZE);
+
 	while(1) {
-		result = fs->fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs->fs_readv(inumber,iov,fill_iovecs(iov, buffers, COPY_BUFFERS * COPY_BUFFER_SIZE),offset);
 		if(result<=0) break;
-		fwrite(buffer,1,result,file);
+		if(!writev_all(fd, iov, fill_iovecs(iov, buffers, result))) {
+			cout << "couldn't write " << filename << "\n";
+			break;
+		}
 		offset += result;
 	}
 
 	cout << offset << " bytes copied\n";
 
-	fclose(file);
+	for(int i = 0; i < COPY_BUFFERS; i++)
+		free(buffers[i]);
+	close(fd);
 	return 1;
 }
-
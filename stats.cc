@@ -0,0 +1,158 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+thread_local Op_Stats::record *Op_Stats::current = nullptr;
+
+namespace {
+
+const char *const NAMES[] = {
+    "fs_format",   "fs_mount",    "fs_umount",       "fs_sync",
+    "fs_debug",    "fs_create",   "fs_create_many",  "fs_delete",
+    "fs_getsize",  "fs_stat",     "fs_read",         "fs_write",
+    "fs_readv",    "fs_writev",   "fs_write_stream", "fs_fallocate",
+    "fs_truncate", "fs_compress", "disk_read",       "disk_write",
+};
+
+/**
+ * A latency in nanoseconds, in the unit that suits it.
+ */
+string duration(long ns) {
+  const char *units[] = {"ns", "us", "ms", "s"};
+  int u = 0;
+  double value = ns;
+  while (value >= 1000 && u < 3) {
+    value /= 1000;
+    u++;
+  }
+  ostringstream out;
+  out << fixed << setprecision(u ? 1 : 0) << value << units[u];
+  return out.str();
+}
+
+}  // namespace
+
+Op_Stats::scope::scope(Op_Stats *s, op o) {
+  r = &s->records[o];
+  previous = current;
+  // The disk calls are timed, but their blocks stay charged to the file
+  // system operation that made them
+  charges = o < DISK_READ;
+  if (charges) current = r;
+  bytes = 0;
+  start = chrono::steady_clock::now();
+}
+
+Op_Stats::scope::~scope() {
+  long ns = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - start)
+                .count();
+  int bucket = ns > 0 ? min(63 - __builtin_clzll(ns), NBUCKETS - 1) : 0;
+
+  r->calls.fetch_add(1, memory_order_relaxed);
+  r->bytes.fetch_add(bytes, memory_order_relaxed);
+  r->nanoseconds.fetch_add(ns, memory_order_relaxed);
+  r->buckets[bucket].fetch_add(1, memory_order_relaxed);
+  if (charges) current = previous;
+}
+
+Op_Stats::Op_Stats() { reset(); }
+
+const char *Op_Stats::name(op o) { return NAMES[o]; }
+
+void Op_Stats::count_blocks(bool write, int n) {
+  record *r = current ? current : &other;
+  (write ? r->writes : r->reads).fetch_add(n, memory_order_relaxed);
+}
+
+void Op_Stats::clear(record *r) {
+  r->calls = 0;
+  r->bytes = 0;
+  r->nanoseconds = 0;
+  r->reads = 0;
+  r->writes = 0;
+  for (auto &b : r->buckets) b = 0;
+}
+
+void Op_Stats::reset() {
+  for (record &r : records) clear(&r);
+  clear(&other);
+}
+
+long Op_Stats::percentile(const record &r, double fraction) {
+  long wanted = (long)(fraction * r.calls), seen = 0;
+  for (int i = 0; i < NBUCKETS; ++i) {
+    seen += r.buckets[i];
+    if (seen > wanted) return 2L << i;
+  }
+  return 2L << (NBUCKETS - 1);
+}
+
+void Op_Stats::print(ostream &out) {
+  out << left << setw(16) << "operation" << right << setw(10) << "calls"
+      << setw(14) << "bytes" << setw(11) << "avg" << setw(11) << "p50"
+      << setw(11) << "p99" << setw(12) << "reads/call" << setw(12)
+      << "writes/call" << "\n";
+
+  for (int o = 0; o < NOPS; ++o) {
+    const record &r = records[o];
+    long calls = r.calls;
+    if (!calls) continue;
+
+    out << left << setw(16) << NAMES[o] << right << setw(10) << calls
+        << setw(14) << r.bytes << setw(11) << duration(r.nanoseconds / calls)
+        << setw(11) << ("<" + duration(percentile(r, 0.5))) << setw(11)
+        << ("<" + duration(percentile(r, 0.99)));
+    if (o < DISK_READ)
+      out << fixed << setprecision(2) << setw(12) << (double)r.reads / calls
+          << setw(12) << (double)r.writes / calls << defaultfloat
+          << setprecision(6);
+    out << "\n";
+  }
+  out << other.reads << " blocks read and " << other.writes
+      << " written outside any operation\n";
+
+  // Only the buckets that have calls
+  out << "\nlatency histograms:\n";
+  for (int o = 0; o < NOPS; ++o) {
+    const record &r = records[o];
+    if (!r.calls) continue;
+    out << "  " << NAMES[o] << ":";
+    for (int i = 0; i < NBUCKETS; ++i)
+      if (r.buckets[i])
+        out << " <" << duration(2L << i) << " " << r.buckets[i];
+    out << "\n";
+  }
+}
+
+void Op_Stats::dump(ostream &out) {
+  out << "{\"operations\": {";
+  bool first = true;
+  for (int o = 0; o < NOPS; ++o) {
+    const record &r = records[o];
+    out << (first ? "" : ", ") << "\"" << NAMES[o] << "\": {\"calls\": "
+        << r.calls << ", \"bytes\": " << r.bytes
+        << ", \"nanoseconds\": " << r.nanoseconds
+        << ", \"block_reads\": " << r.reads
+        << ", \"block_writes\": " << r.writes << ", \"histogram\": [";
+    for (int i = 0; i < NBUCKETS; ++i)
+      out << (i ? ", " : "") << r.buckets[i];
+    out << "]}";
+    first = false;
+  }
+  out << "}, \"other\": {\"block_reads\": " << other.reads
+      << ", \"block_writes\": " << other.writes << "}}\n";
+}
+
+void Op_Stats::close() {
+  if (dump_file.empty()) return;
+  ofstream out(dump_file);
+  if (out)
+    dump(out);
+  else
+    cout << "Error when writing the statistics to " << dump_file << "\n";
+}
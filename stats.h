@@ -0,0 +1,134 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+
+using namespace std;
+
+/**
+ * Call counts, bytes, latency histograms and disk blocks transferred, per
+ * file system operation. Each public INE5412_FS method and Disk::read and
+ * Disk::write time themselves with a scope. Blocks the disk transfers are
+ * charged to the file system operation running in the same thread, so that
+ * it shows, for instance, how many block reads one fs_read causes on
+ * average; blocks transferred outside any operation are counted apart.
+ *
+ * Everything is counted with relaxed atomics and two clock reads per call,
+ * cheap enough to stay on all the time.
+ */
+class Op_Stats {
+ public:
+  enum op {
+    FS_FORMAT,
+    FS_MOUNT,
+    FS_UMOUNT,
+    FS_SYNC,
+    FS_DEBUG,
+    FS_CREATE,
+    FS_CREATE_MANY,
+    FS_DELETE,
+    FS_GETSIZE,
+    FS_STAT,
+    FS_READ,
+    FS_WRITE,
+    FS_READV,
+    FS_WRITEV,
+    FS_WRITE_STREAM,
+    FS_FALLOCATE,
+    FS_TRUNCATE,
+    FS_COMPRESS,
+    DISK_READ,
+    DISK_WRITE,
+    NOPS
+  };
+
+  // Latencies of bucket i are in [2^i, 2^(i+1)) nanoseconds.
+  static const int NBUCKETS = 40;
+
+ private:
+  struct record {
+    atomic<long> calls;
+    atomic<long> bytes;
+    atomic<long> nanoseconds;
+    atomic<long> reads;
+    atomic<long> writes;
+    atomic<long> buckets[NBUCKETS];
+  };
+
+ public:
+  /**
+   * Times one call of an operation, from construction to destruction. For a
+   * file system operation, disk blocks transferred by the thread meanwhile
+   * are charged to it.
+   */
+  class scope {
+   public:
+    scope(Op_Stats *s, op o);
+    ~scope();
+
+    /**
+     * Bytes the call read or wrote.
+     */
+    void set_bytes(long n) { bytes = n; }
+
+   private:
+    record *r;
+    record *previous;
+    bool charges;
+    long bytes;
+    chrono::steady_clock::time_point start;
+  };
+
+  Op_Stats();
+
+  /**
+   * Count n blocks read or written, for the operation running in this
+   * thread.
+   */
+  void count_blocks(bool write, int n);
+
+  void reset();
+
+  /**
+   * Print a table of the operations called so far and their latency
+   * histograms.
+   */
+  void print(ostream &out);
+
+  /**
+   * Write the counters as JSON.
+   */
+  void dump(ostream &out);
+
+  /**
+   * Have close() write the counters as JSON to path.
+   */
+  void set_dump_file(const char *path) { dump_file = path; }
+
+  /**
+   * Called when the disk is closed.
+   */
+  void close();
+
+  static const char *name(op o);
+
+ private:
+  record records[NOPS];
+  // Blocks transferred outside any operation
+  record other;
+  string dump_file;
+
+  static thread_local record *current;
+
+  static void clear(record *r);
+
+  /**
+   * Upper bound of the bucket holding the given fraction of the calls.
+   */
+  static long percentile(const record &r, double fraction);
+};
+
+#endif
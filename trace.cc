@@ -0,0 +1,54 @@
+#include "trace.h"
+
+Trace_Recorder::Trace_Recorder(Disk *d) {
+  active = false;
+  file = nullptr;
+  nrecords = 0;
+
+  // Registered before the file system's own hook, so it runs after the
+  // unmount on close and the unmount is recorded
+  d->add_close_hook([this]() { stop(); });
+}
+
+bool Trace_Recorder::start(const char *path) {
+  lock_guard<mutex> lock(m);
+  if (file) fclose(file);
+  active = false;
+
+  file = fopen(path, "wb");
+  if (!file) return false;
+
+  header h = {MAGIC, VERSION};
+  fwrite(&h, sizeof(h), 1, file);
+  nrecords = 0;
+  last = chrono::steady_clock::now();
+  active = true;
+  return true;
+}
+
+long Trace_Recorder::stop() {
+  lock_guard<mutex> lock(m);
+  active = false;
+  if (file) {
+    fclose(file);
+    file = nullptr;
+  }
+  return nrecords;
+}
+
+void Trace_Recorder::add(record r, const int *inodes, int ninodes) {
+  lock_guard<mutex> lock(m);
+  if (!file) return;
+
+  chrono::steady_clock::time_point now = chrono::steady_clock::now();
+  long us = chrono::duration_cast<chrono::microseconds>(now - last).count();
+  r.delay = us > UINT32_MAX ? UINT32_MAX : us;
+  last = now;
+
+  fwrite(&r, sizeof(r), 1, file);
+  for (int i = 0; i < ninodes; ++i) {
+    record inode = {0, INODE, {0, 0, 0}, inodes[i], 0, 0, 0};
+    fwrite(&inode, sizeof(inode), 1, file);
+  }
+  nrecords += 1 + ninodes;
+}
@@ -0,0 +1,121 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#include "disk.h"
+
+/**
+ * Records the file system calls made while tracing is on into a binary
+ * trace file, for simplefs_replay to run again on a fresh image. The file
+ * starts with a header and holds one record per call, in the order the
+ * calls finished, carrying its arguments, its result and the time since
+ * the previous record. Only the length of the data read or written is
+ * kept, not the data.
+ *
+ * A call of fs_create_many is followed by one INODE record per inode it
+ * created, and fs_readv, fs_writev and fs_write_stream are recorded as a
+ * READ or WRITE of their total length. Calls from several threads may be recorded at once.
+ */
+class Trace_Recorder {
+ public:
+  static const uint32_t MAGIC = 0x52544653;
+  static const uint32_t VERSION = 1;
+
+  enum op : uint8_t {
+    FORMAT = 1,
+    MOUNT,
+    UMOUNT,
+    SYNC,
+    CREATE,
+    CREATE_MANY,
+    DELETE,
+    GETSIZE,
+    STAT,
+    READ,
+    WRITE,
+    // An inode created by the CREATE_MANY before it
+    INODE,
+    FALLOCATE,
+    TRUNCATE,
+    COMPRESS,
+  };
+
+  struct header {
+    uint32_t magic;
+    uint32_t version;
+  };
+
+  struct record {
+    // Microseconds since the previous record
+    uint32_t delay;
+    uint8_t op;
+    uint8_t unused[3];
+    int32_t inumber;
+    int32_t offset;
+    int32_t length;
+    int32_t result;
+  };
+
+  /**
+   * Records one call, from construction to destruction. The result is 0,
+   * which is how the file system reports failure, until set_result.
+   */
+  class call {
+   public:
+    call(Trace_Recorder *t, op o, int inumber = 0, int offset = 0,
+         int length = 0)
+        : tracer(t), r{0, o, {0, 0, 0}, inumber, offset, length, 0} {}
+    ~call() {
+      if (tracer->active) tracer->add(r, inodes, ninodes);
+    }
+
+    void set_result(int result) { r.result = result; }
+
+    /**
+     * Inodes created by fs_create_many, recorded after the call.
+     */
+    void set_inodes(const int *i, int n) {
+      inodes = i;
+      ninodes = n;
+    }
+
+   private:
+    Trace_Recorder *tracer;
+    record r;
+    const int *inodes = nullptr;
+    int ninodes = 0;
+  };
+
+  Trace_Recorder(Disk *d);
+
+  /**
+   * Start recording to the file at path, replacing it. Returns false if it
+   * could not be created.
+   */
+  bool start(const char *path);
+
+  /**
+   * Stop recording and close the trace file; returns how many records it
+   * holds.
+   */
+  long stop();
+
+  bool recording() { return active; }
+
+ private:
+  mutex m;
+  atomic<bool> active;
+  FILE *file;
+  long nrecords;
+  chrono::steady_clock::time_point last;
+
+  void add(record r, const int *inodes, int ninodes);
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "writebuf.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+Write_Buffer::Write_Buffer(Disk *d) {
+  disk = d;
+  nbuffered = 0;
+  nflushed = 0;
+
+  disk->add_close_hook([this]() { report(); });
+}
+
+char *Write_Buffer::lookup(int inumber, int index) {
+  lock_guard<mutex> lock(m);
+  auto it = pages.find({inumber, index});
+  return it == pages.end() ? nullptr : it->second.data;
+}
+
+char *Write_Buffer::page(int inumber, int index, int blocknum, bool fill) {
+  lock_guard<mutex> lock(m);
+  nbuffered++;
+
+  auto it = pages.find({inumber, index});
+  if (it != pages.end()) return it->second.data;
+
+  entry &e = pages[{inumber, index}];
+  e.blocknum = blocknum;
+  if (fill)
+    disk->read(blocknum, e.data);
+  else
+    memset(e.data, 0, Disk::DISK_BLOCK_SIZE);
+  return e.data;
+}
+
+void Write_Buffer::drop(int inumber, int index) {
+  lock_guard<mutex> lock(m);
+  pages.erase({inumber, index});
+}
+
+void Write_Buffer::forget(int inumber, int from) {
+  lock_guard<mutex> lock(m);
+  pages.erase(pages.lower_bound({inumber, from}),
+              pages.lower_bound({inumber + 1, 0}));
+}
+
+void Write_Buffer::flush() {
+  lock_guard<mutex> lock(m);
+  if (pages.empty()) return;
+
+  // Submit in block order so that neighbouring blocks are written one after
+  // the other; the writes are all in flight at once.
+  vector<entry *> order;
+  for (auto &p : pages) order.push_back(&p.second);
+  sort(order.begin(), order.end(),
+       [](entry *a, entry *b) { return a->blocknum < b->blocknum; });
+
+  atomic<int> inFlight(order.size());
+  for (entry *e : order)
+    disk->submit_write(e->blocknum, e->data, [&inFlight]() { inFlight--; });
+  while (inFlight) disk->poll(true);
+
+  nflushed += order.size();
+  pages.clear();
+}
+
+void Write_Buffer::report() {
+  cout << nbuffered << " buffered writes\n";
+  cout << nflushed << " buffered blocks written\n";
+}
@@ -0,0 +1,86 @@
+#ifndef WRITEBUF_H
+#define WRITEBUF_H
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include "disk.h"
+
+/**
+ * Buffer for partial writes of file data. A write that covers only part of
+ * a block changes a copy of the block kept here, read from the disk the
+ * first time (so the rest of the block is preserved) or zeroed if the block
+ * is new. Later small writes to the same block, such as a stream of short
+ * appends, change the same copy, and the block reaches the disk only once
+ * when the buffer is flushed: when it holds CAPACITY blocks, before each
+ * journal commit, on fs_umount and on fs_sync.
+ *
+ * Calls from several threads are safe. The copy returned by lookup or page
+ * stays valid until it is dropped, forgotten or flushed, which the file
+ * system only does while no other operation uses that inode.
+ */
+class Write_Buffer {
+ public:
+  static const int CAPACITY = 64;
+
+  Write_Buffer(Disk *d);
+
+  /**
+   * Return the buffered copy of block index of inumber, or null if there is
+   * none.
+   */
+  char *lookup(int inumber, int index);
+
+  /**
+   * Return the buffered copy of block index of inumber, stored in disk block
+   * blocknum, creating it if needed: read from the disk if fill is set,
+   * zeroed otherwise.
+   */
+  char *page(int inumber, int index, int blocknum, bool fill);
+
+  /**
+   * Drop the copy of block index of inumber, which is about to be
+   * overwritten as a whole.
+   */
+  void drop(int inumber, int index);
+
+  /**
+   * Drop every copy of inumber from block index from on, whose blocks are
+   * about to be freed.
+   */
+  void forget(int inumber, int from = 0);
+
+  bool full() {
+    lock_guard<mutex> lock(m);
+    return (int)pages.size() >= CAPACITY;
+  }
+
+  /**
+   * Write every buffered block to the disk, in block order, and empty the
+   * buffer.
+   */
+  void flush();
+
+  /**
+   * Print the write buffer counters.
+   */
+  void report();
+
+ private:
+  struct entry {
+    int blocknum;
+    char data[Disk::DISK_BLOCK_SIZE];
+  };
+
+  Disk *disk;
+  mutex m;
+  // Keyed by inode and block index, so that the copies of one inode are
+  // next to each other.
+  map<pair<int, int>, entry> pages;
+
+  int nbuffered;
+  int nflushed;
+};
+
+#endif